@@ -0,0 +1,247 @@
+/*
+ * Headless benchmark for the torch render pipeline
+ *
+ * Renders frames as fast as possible into a sink which throws them away and
+ * reports how long each stage took per frame.
+ */
+
+#include <err.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <ccan/ciniparser/ciniparser.h>
+
+#include "config.h"
+#include "font.h"
+#include "kernel.h"
+#include "sink.h"
+#include "torch.h"
+
+static int	u64cmp(const void *a, const void *b);
+static void	report(const char *name, uint64_t *ns, int nframes, int csv, const char *geom, int fused);
+
+void
+usage(const char *argv0)
+{
+	fprintf(stderr, "%s [-c config] [-g WxH] [-n frames] [-w warmup] [-b bands] [-k kernel] [-m message] [-C] [-H]\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Time each stage of rendering the first torch in config without sending anything\n");
+	fprintf(stderr, "-C prints CSV so runs can be compared\n");
+	fprintf(stderr, "-H prints a hash of every frame rendered instead, to check the output hasn't changed\n");
+
+	exit(EX_USAGE);
+}
+
+static int
+u64cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return(x < y ? -1 : x > y);
+}
+
+/* Print stats for one stage, ns is sorted in place */
+static void
+report(const char *name, uint64_t *ns, int nframes, int csv, const char *geom, int fused)
+{
+	uint64_t sum;
+	int i, p99;
+
+	sum = 0;
+	for (i = 0; i < nframes; i++)
+		sum += ns[i];
+	qsort(ns, nframes, sizeof(ns[0]), u64cmp);
+	p99 = (nframes * 99 + 99) / 100 - 1;
+
+	if (csv)
+		printf("%s,%s,%s,%d,%d,%llu,%llu,%llu,%llu\n", name, geom, kernel_name(), fused, nframes,
+		    (unsigned long long)(sum / nframes), (unsigned long long)ns[0],
+		    (unsigned long long)ns[nframes / 2], (unsigned long long)ns[p99]);
+	else
+		printf("%-10s %10llu %10llu %10llu %10llu\n", name,
+		    (unsigned long long)(sum / nframes), (unsigned long long)ns[0],
+		    (unsigned long long)ns[nframes / 2], (unsigned long long)ns[p99]);
+}
+
+int
+main(int argc, char **argv)
+{
+	char *secname, *simd, *msg, geom[32];
+	const char *argv0;
+	int ch, csv, dohash, fused, i, s, nframes, nwarm, bands, w, h;
+	uint64_t t[NSTAGES], *ns, hash;
+	struct config_t conf;
+	struct sink_t *sink;
+	struct torch_t *torch;
+	dictionary *ini;
+	struct option longopts[] = {
+		{ "bands",	required_argument,	NULL,	'b' },
+		{ "config",	required_argument,	NULL, 	'c' },
+		{ "csv",	no_argument,		NULL,	'C' },
+		{ "geometry",	required_argument,	NULL,	'g' },
+		{ "hash",	no_argument,		NULL,	'H' },
+		{ "kernel",	required_argument,	NULL,	'k' },
+		{ "message",	required_argument,	NULL,	'm' },
+		{ "frames",	required_argument,	NULL,	'n' },
+		{ "warmup",	required_argument,	NULL,	'w' },
+		{ NULL,		0,			NULL,	0 }
+	};
+
+	argv0 = argv[0];
+	ini = NULL;
+	simd = msg = NULL;
+	csv = dohash = 0;
+	nframes = 1000;
+	nwarm = 100;
+	bands = w = h = -1;
+
+	while ((ch = getopt_long(argc, argv, "b:c:Cg:Hk:m:n:w:", longopts, NULL)) != -1) {
+		switch (ch) {
+			case 'b':
+				if ((bands = atoi(optarg)) <= 0)
+					errx(EX_DATAERR, "Band count must be greater than 0");
+				break;
+
+			case 'c':
+				if ((ini = ciniparser_load(optarg)) == NULL)
+					exit(EX_DATAERR);
+				break;
+
+			case 'C':
+				csv = 1;
+				break;
+
+			case 'g':
+				if (sscanf(optarg, "%dx%d", &w, &h) != 2 || w <= 0 || h <= 1)
+					errx(EX_DATAERR, "Geometry must be LEDs per level x levels, e.g. 21x23");
+				break;
+
+			case 'H':
+				dohash = 1;
+				break;
+
+			case 'k':
+				simd = optarg;
+				break;
+
+			case 'm':
+				msg = optarg;
+				break;
+
+			case 'n':
+				if ((nframes = atoi(optarg)) <= 0)
+					errx(EX_DATAERR, "Frame count must be greater than 0");
+				break;
+
+			case 'w':
+				if ((nwarm = atoi(optarg)) < 0)
+					errx(EX_DATAERR, "Warmup count can't be negative");
+				break;
+
+			default:
+				usage(argv0);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 0)
+		usage(argv0);
+
+	kernel_init();
+	if (simd == NULL && ini != NULL)
+		simd = ciniparser_getstring(ini, "global:simd", NULL);
+	if (simd != NULL && kernel_select(simd) != 0)
+		errx(EX_DATAERR, "SIMD kernel %s is not available", simd);
+
+	/* Use the first torch in the config, or the example geometry */
+	default_conf(&conf);
+	for (i = 1; ini != NULL && i <= ciniparser_getnsec(ini); i++) {
+		secname = ciniparser_getsecname(ini, i);
+		if (strcmp(secname, "global")) {
+			if (ini2conf(ini, secname, &conf) != 0)
+				exit(EX_DATAERR);
+			break;
+		}
+	}
+	if (conf.leds_per_level == -1) {
+		conf.leds_per_level = 21;
+		conf.torch_levels = 23;
+	}
+	if (w != -1) {
+		conf.leds_per_level = w;
+		conf.torch_levels = h;
+	}
+	if (bands != -1)
+		conf.band_threads = bands;
+	if (conf.wound_cwise == -1)
+		conf.wound_cwise = 0;
+	if (conf.torch_chan == -1)
+		conf.torch_chan = 0;
+	/* Same flame every run so builds can be compared */
+	if (conf.seed == 0)
+		conf.seed = 1;
+	/* Always render at full quality, there is no frame budget here */
+	conf.governor = 0;
+	if ((long long)conf.leds_per_level * conf.torch_levels > MAX_LEDS)
+		errx(EX_DATAERR, "Too many LEDs");
+	if (conf.text_base_line + ROWS_PER_GLYPH > conf.torch_levels)
+		conf.text_base_line = conf.torch_levels - ROWS_PER_GLYPH > 0 ? conf.torch_levels - ROWS_PER_GLYPH : 0;
+
+	if ((ns = calloc((size_t)nframes * (NSTAGES + 1), sizeof(ns[0]))) == NULL)
+		errx(EX_OSERR, "Unable to allocate timing buffer");
+	if ((torch = create_torch("bench", &conf)) == NULL)
+		errx(EX_OSERR, "Failed to create torch");
+	if ((sink = sink_null()) == NULL || add_sink(torch, sink, -1) != 0)
+		exit(EX_OSERR);
+	if (msg != NULL)
+		newMessage(torch, msg);
+
+	hash = TORCH_HASH_INIT;
+	for (i = 0; i < nwarm; i++) {
+		run_torch(torch);
+		if (dohash)
+			hash = torch_hash(torch, hash);
+	}
+	for (i = 0; i < nframes; i++) {
+		memset(t, 0, sizeof(t));
+		run_torch_timed(torch, t);
+		if (dohash)
+			hash = torch_hash(torch, hash);
+		ns[NSTAGES * nframes + i] = 0;
+		for (s = 0; s < NSTAGES; s++) {
+			ns[s * nframes + i] = t[s];
+			ns[NSTAGES * nframes + i] += t[s];
+		}
+	}
+
+	snprintf(geom, sizeof(geom), "%dx%d", conf.leds_per_level, conf.torch_levels);
+	/* The fused pass does the colours in the energy stage, sim_rate never uses it */
+	fused = conf.fused && conf.sim_rate == 0;
+	if (dohash) {
+		printf("%016llx\n", (unsigned long long)hash);
+		goto out;
+	}
+	if (csv)
+		printf("stage,geometry,kernel,fused,frames,mean_ns,min_ns,median_ns,p99_ns\n");
+	else {
+		printf("%s (%d LEDs), %s kernel, %d band threads, %d frames, fused=%d%s\n", geom,
+		    conf.leds_per_level * conf.torch_levels, kernel_name(), conf.band_threads, nframes,
+		    fused, fused ? " (colours are counted in energy)" : "");
+		printf("%-10s %10s %10s %10s %10s\n", "ns/frame", "mean", "min", "median", "p99");
+	}
+	for (s = 0; s < NSTAGES; s++)
+		report(stage_name(s), ns + s * nframes, nframes, csv, geom, fused);
+	report("total", ns + NSTAGES * nframes, nframes, csv, geom, fused);
+
+  out:
+	free_torch(torch);
+	free(ns);
+	if (ini != NULL)
+		ciniparser_freedict(ini);
+
+	return(0);
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Render seeded torches every way the flame can be computed and check the
+# frames are the same as they have always been, "make check" to run
+#
+# Every kernel, the fused and two pass paths and any number of bands have
+# to give the same frames, a change which alters the output on purpose has
+# to update the hashes here.
+
+BENCH=${1:-./opctorch-bench}
+FRAMES=500
+MSG="Check 123"
+
+conf=$(mktemp) || exit 1
+trap 'rm -f $conf' EXIT
+fail=0
+
+# geometry upside_down hash
+while read geom ud want; do
+	for kernel in scalar auto; do
+		for fused in 1 0; do
+			for bands in 1 4; do
+				cat > $conf <<-EOF
+				[torch]
+				leds_per_level = ${geom%x*}
+				torch_levels = ${geom#*x}
+				wound_cwise = 0
+				torch_chan = 0
+				upside_down = $ud
+				fused = $fused
+				seed = 1
+				EOF
+				got=$($BENCH -c $conf -k $kernel -b $bands -n $FRAMES -w 0 -m "$MSG" -H)
+				if [ "$got" != "$want" ]; then
+					echo "FAIL $geom upside_down=$ud kernel=$kernel fused=$fused bands=$bands: $got, expected $want"
+					fail=1
+				fi
+			done
+		done
+	done
+done <<EOF
+21x23 0 a7a478110fedfaf4
+21x23 1 7326d7852c453a96
+180x120 0 caf381d92c91de3f
+EOF
+
+[ $fail = 0 ] && echo "All frames match"
+exit $fail
@@ -1,10 +1,26 @@
 /* Number of LEDs (only used for test code) */
 #define NLEDS 256
 
+/* Most LEDs in one torch */
+#define MAX_LEDS (1 << 24)
+
+/* Most OPC servers a torch can send to */
+#define MAX_SERVERS 4
+
+struct server_t {
+	char	*host;		// Hostname/IP
+	char	*port;		// Number/service name
+	int	proto;		// SINK_TCP, SINK_UDP, SINK_SHM, SINK_SACN, SINK_ARTNET or SINK_REC
+	int	chan;		// OPC channel on this server, -1 to use torch_chan
+	int	universe;	// First sACN/Art-Net universe, -1 for the default
+};
+
 struct config_t {
-	/* Hostname/IP and number/service name of OPC server */
-	char	*srvhost;
-	char	*srvport;
+	/* OPC servers, every frame is sent to all of them */
+	struct server_t	servers[MAX_SERVERS];
+	int	nservers;
+	int	udp_size;	// Largest datagram to send, bigger frames are split over channels
+	int	chan_pixels;	// Pixels per OPC channel, bigger frames are split over channels (0 = as many as fit)
 
 	/* Number of LEDs around the tube. One too much looks better (italic text look)
 	 * than one to few (backwards leaning text look)
@@ -68,6 +84,16 @@ struct config_t {
 	int	upside_down;	// If set, flame animation is upside down. Text remains as-is
 
 	int	update_rate;	// Update rate target (FPS)
+	int	sim_rate;	// Flame steps per second, frames in between are interpolated (0 = one per frame)
+	int	catch_up;	// Render frames which missed their deadline back to back, otherwise skip them
+	int	governor;	// Lower the quality when frames take too long to render
+	int	keepalive;	// Resend an unchanged frame after this many ms (0 = always send)
+
+	int	seed;		// Random number seed, 0 to pick one at start up
+
+	int	band_threads;	// Threads to simulate large torches with (in bands of at least 2048 LEDs)
+	int	spark_compat;	// Move sparks in cell order like the original, otherwise all at once
+	int	fused;		// Work out energy and colours in one pass, otherwise two like the original
 
 	char	colour_order[3];
 };
@@ -0,0 +1,96 @@
+/* Latency histograms
+ *
+ * Adding a value is a handful of instructions and never takes a lock, each
+ * histogram only has one writer so plain loads and stores are enough. They
+ * are atomic so a reader on another thread sees whole values, the summary
+ * it gets may be a frame or two out of date but never garbage.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "hist.h"
+
+#define LOAD(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+static int	bucket(uint64_t);
+static uint64_t	bucketmax(int);
+
+/* Bucket a value falls into */
+static int
+bucket(uint64_t v)
+{
+	int e;
+
+	if (v < (1 << HIST_SUBBITS))
+		return(v);
+	e = 63 - __builtin_clzll(v);
+	return(((e - HIST_SUBBITS + 1) << HIST_SUBBITS) |
+	    ((v >> (e - HIST_SUBBITS)) & ((1 << HIST_SUBBITS) - 1)));
+}
+
+/* Highest value in a bucket */
+static uint64_t
+bucketmax(int b)
+{
+	int shift;
+
+	if (b < (1 << HIST_SUBBITS))
+		return(b);
+	shift = (b >> HIST_SUBBITS) - 1;
+	return((((uint64_t)(b & ((1 << HIST_SUBBITS) - 1)) | (1 << HIST_SUBBITS)) << shift) +
+	    ((uint64_t)1 << shift) - 1);
+}
+
+void
+hist_add(struct hist_t *h, uint64_t v)
+{
+	uint64_t *b;
+
+	b = &h->buckets[bucket(v)];
+	STORE(b, LOAD(b) + 1);
+	if (LOAD(&h->count) == 0 || v < LOAD(&h->min))
+		STORE(&h->min, v);
+	if (v > LOAD(&h->max))
+		STORE(&h->max, v);
+	STORE(&h->count, LOAD(&h->count) + 1);
+}
+
+/* Summarise a histogram, percentiles are the top of the bucket they fall in */
+void
+hist_read(const struct hist_t *h, struct histsum_t *sum)
+{
+	uint64_t buckets[HIST_BUCKETS], n, p50, p99, seen;
+	int b, half;
+
+	memset(sum, 0, sizeof(*sum));
+	for (b = 0, n = 0; b < HIST_BUCKETS; b++)
+		n += buckets[b] = LOAD(&h->buckets[b]);
+	if (n == 0)
+		return;
+	sum->count = n;
+	sum->min = LOAD(&h->min);
+	sum->max = LOAD(&h->max);
+
+	p50 = (n + 1) / 2;
+	p99 = (n * 99 + 99) / 100;
+	for (b = 0, seen = 0, half = 0; b < HIST_BUCKETS; b++) {
+		if (buckets[b] == 0)
+			continue;
+		seen += buckets[b];
+		if (!half && seen >= p50) {
+			sum->p50 = bucketmax(b);
+			half = 1;
+		}
+		if (seen >= p99) {
+			sum->p99 = bucketmax(b);
+			break;
+		}
+	}
+	/* The max may have been updated before the bucket or the other way around */
+	if (sum->p50 > sum->max)
+		sum->p50 = sum->max;
+	if (sum->p99 > sum->max)
+		sum->p99 = sum->max;
+}
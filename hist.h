@@ -0,0 +1,27 @@
+/* Log-linear latency histogram
+ *
+ * Values below 2^HIST_SUBBITS have a bucket each, above that each power of
+ * two is split into 2^HIST_SUBBITS buckets so any value is within about 6%.
+ * Only one thread may add to a histogram at a time, anyone can read it.
+ */
+#define HIST_SUBBITS	4
+#define HIST_BUCKETS	((64 - HIST_SUBBITS + 1) << HIST_SUBBITS)
+
+struct hist_t {
+	uint64_t	count;
+	uint64_t	min;
+	uint64_t	max;
+	uint64_t	buckets[HIST_BUCKETS];
+};
+
+/* What a histogram looked like when it was read */
+struct histsum_t {
+	uint64_t	count;
+	uint64_t	min;
+	uint64_t	p50;
+	uint64_t	p99;
+	uint64_t	max;
+};
+
+void	hist_add(struct hist_t *, uint64_t);
+void	hist_read(const struct hist_t *, struct histsum_t *);
@@ -0,0 +1,303 @@
+/* Flame simulation kernels
+ *
+ * Passive cells make up almost all of the torch and their update only
+ * depends on the current energy of the cell and its left, right and lower
+ * neighbours, so it is done a whole run of cells at a time with saturating
+ * byte arithmetic. The best implementation the CPU supports is picked at
+ * run time, the scalar version is the reference the others must match.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON
+#include <arm_neon.h>
+#if defined(__arm__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+#include "kernel.h"
+
+typedef void (*passive_fn)(uint8_t *, const uint8_t *, int, int, const struct kparams_t *);
+
+struct kernel_t {
+	const char	*name;
+	int		(*supported)(void);
+	passive_fn	passive;
+};
+
+static int	has_scalar(void);
+static void	passive_scalar(uint8_t *, const uint8_t *, int, int, const struct kparams_t *);
+#ifdef HAVE_X86
+static int	has_sse2(void);
+static int	has_avx2(void);
+static void	passive_sse2(uint8_t *, const uint8_t *, int, int, const struct kparams_t *);
+static void	passive_avx2(uint8_t *, const uint8_t *, int, int, const struct kparams_t *);
+#endif
+#ifdef HAVE_NEON
+static int	has_neon(void);
+static void	passive_neon(uint8_t *, const uint8_t *, int, int, const struct kparams_t *);
+#endif
+
+/* Best first, scalar must be last */
+static const struct kernel_t kernels[] = {
+#ifdef HAVE_X86
+	{ "avx2",	has_avx2,	passive_avx2 },
+	{ "sse2",	has_sse2,	passive_sse2 },
+#endif
+#ifdef HAVE_NEON
+	{ "neon",	has_neon,	passive_neon },
+#endif
+	{ "scalar",	has_scalar,	passive_scalar },
+};
+#define NKERNELS	(sizeof(kernels) / sizeof(kernels[0]))
+
+static const struct kernel_t *kernel = &kernels[NKERNELS - 1];
+
+/* Pick the best kernel for this CPU */
+void
+kernel_init(void)
+{
+	unsigned int i;
+
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+#endif
+	for (i = 0; i < NKERNELS; i++) {
+		if (kernels[i].supported()) {
+			kernel = &kernels[i];
+			return;
+		}
+	}
+}
+
+/* Force a particular kernel, returns -1 if it isn't available */
+int
+kernel_select(const char *name)
+{
+	unsigned int i;
+
+	if (!strcmp(name, "auto")) {
+		kernel_init();
+		return(0);
+	}
+	for (i = 0; i < NKERNELS; i++) {
+		if (!strcmp(kernels[i].name, name) && kernels[i].supported()) {
+			kernel = &kernels[i];
+			return(0);
+		}
+	}
+
+	return(-1);
+}
+
+const char *
+kernel_name(void)
+{
+
+	return(kernel->name);
+}
+
+/* Compute the next energy of passive cells [start, end)
+ * start must be on the second level or above so every cell has a lower
+ * and a left neighbour, the last cell of the torch has no right neighbour.
+ */
+void
+passive_cells(uint8_t *next, const uint8_t *cur, int start, int end, const struct kparams_t *kp)
+{
+
+	/* Vector versions work in bytes so only handle 8 bit parameters */
+	if (kp->heat_cap < 0 || kp->heat_cap > 255 ||
+	    kp->side_rad < 0 || kp->side_rad > 255 ||
+	    kp->up_rad < 0 || kp->up_rad > 255)
+		passive_scalar(next, cur, start, end, kp);
+	else
+		kernel->passive(next, cur, start, end, kp);
+}
+
+static int
+has_scalar(void)
+{
+
+	return(1);
+}
+
+static void
+passive_scalar(uint8_t *next, const uint8_t *cur, int start, int end, const struct kparams_t *kp)
+{
+	int i, r;
+	uint8_t e, tmp, amt;
+
+	for (i = start; i < end; i++) {
+		e = ((int)cur[i] * kp->heat_cap) >> 8;
+		if (i < kp->numleds - 1)
+			tmp = cur[i + 1];
+		else
+			tmp = 0;
+		/* The radiation sum is truncated to a byte before being added */
+		amt = ((((int)cur[i - 1] + (int)tmp) * kp->side_rad) >> 9) +
+		    (((int)cur[i - kp->leds_per_level] * kp->up_rad) >> 8);
+		r = e + amt;
+		next[i] = r > 255 ? 255 : r;
+	}
+}
+
+#ifdef HAVE_X86
+/*
+ * Products are done in 16 bit lanes with mulhi against a pre-shifted
+ * factor, i.e. (x * f) >> 8 == mulhi(x, f << 8) and
+ * ((l + r) * f) >> 9 == mulhi(l + r, f << 7), which keeps everything in
+ * range without needing 32 bit intermediates.
+ */
+__attribute__((target("sse2")))
+static int
+has_sse2(void)
+{
+
+	return(__builtin_cpu_supports("sse2"));
+}
+
+__attribute__((target("avx2")))
+static int
+has_avx2(void)
+{
+
+	return(__builtin_cpu_supports("avx2"));
+}
+
+__attribute__((target("sse2")))
+static void
+passive_sse2(uint8_t *next, const uint8_t *cur, int start, int end, const struct kparams_t *kp)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i low = _mm_set1_epi16(0xff);
+	const __m128i hc = _mm_set1_epi16(kp->heat_cap << 8);
+	const __m128i sr = _mm_set1_epi16(kp->side_rad << 7);
+	const __m128i ur = _mm_set1_epi16(kp->up_rad << 8);
+	__m128i c, l, r, d, e0, e1, a0, a1;
+	int i, vend, lpl;
+
+	lpl = kp->leds_per_level;
+	/* Each block reads the cell to the right of its last cell */
+	vend = end < kp->numleds - 1 ? end : kp->numleds - 1;
+	for (i = start; i + 16 <= vend; i += 16) {
+		c = _mm_loadu_si128((const __m128i *)(cur + i));
+		l = _mm_loadu_si128((const __m128i *)(cur + i - 1));
+		r = _mm_loadu_si128((const __m128i *)(cur + i + 1));
+		d = _mm_loadu_si128((const __m128i *)(cur + i - lpl));
+
+		e0 = _mm_mulhi_epu16(_mm_unpacklo_epi8(c, zero), hc);
+		e1 = _mm_mulhi_epu16(_mm_unpackhi_epi8(c, zero), hc);
+		a0 = _mm_add_epi16(
+		    _mm_mulhi_epu16(_mm_add_epi16(_mm_unpacklo_epi8(l, zero), _mm_unpacklo_epi8(r, zero)), sr),
+		    _mm_mulhi_epu16(_mm_unpacklo_epi8(d, zero), ur));
+		a1 = _mm_add_epi16(
+		    _mm_mulhi_epu16(_mm_add_epi16(_mm_unpackhi_epi8(l, zero), _mm_unpackhi_epi8(r, zero)), sr),
+		    _mm_mulhi_epu16(_mm_unpackhi_epi8(d, zero), ur));
+		a0 = _mm_and_si128(a0, low);
+		a1 = _mm_and_si128(a1, low);
+
+		_mm_storeu_si128((__m128i *)(next + i),
+		    _mm_adds_epu8(_mm_packus_epi16(e0, e1), _mm_packus_epi16(a0, a1)));
+	}
+	passive_scalar(next, cur, i, end, kp);
+}
+
+/* Same as SSE2 but 32 cells at a time, unpack and pack both work within
+ * 128 bit lanes so the byte order comes out right without any permutes */
+__attribute__((target("avx2")))
+static void
+passive_avx2(uint8_t *next, const uint8_t *cur, int start, int end, const struct kparams_t *kp)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i low = _mm256_set1_epi16(0xff);
+	const __m256i hc = _mm256_set1_epi16(kp->heat_cap << 8);
+	const __m256i sr = _mm256_set1_epi16(kp->side_rad << 7);
+	const __m256i ur = _mm256_set1_epi16(kp->up_rad << 8);
+	__m256i c, l, r, d, e0, e1, a0, a1;
+	int i, vend, lpl;
+
+	lpl = kp->leds_per_level;
+	vend = end < kp->numleds - 1 ? end : kp->numleds - 1;
+	for (i = start; i + 32 <= vend; i += 32) {
+		c = _mm256_loadu_si256((const __m256i *)(cur + i));
+		l = _mm256_loadu_si256((const __m256i *)(cur + i - 1));
+		r = _mm256_loadu_si256((const __m256i *)(cur + i + 1));
+		d = _mm256_loadu_si256((const __m256i *)(cur + i - lpl));
+
+		e0 = _mm256_mulhi_epu16(_mm256_unpacklo_epi8(c, zero), hc);
+		e1 = _mm256_mulhi_epu16(_mm256_unpackhi_epi8(c, zero), hc);
+		a0 = _mm256_add_epi16(
+		    _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_unpacklo_epi8(l, zero), _mm256_unpacklo_epi8(r, zero)), sr),
+		    _mm256_mulhi_epu16(_mm256_unpacklo_epi8(d, zero), ur));
+		a1 = _mm256_add_epi16(
+		    _mm256_mulhi_epu16(_mm256_add_epi16(_mm256_unpackhi_epi8(l, zero), _mm256_unpackhi_epi8(r, zero)), sr),
+		    _mm256_mulhi_epu16(_mm256_unpackhi_epi8(d, zero), ur));
+		a0 = _mm256_and_si256(a0, low);
+		a1 = _mm256_and_si256(a1, low);
+
+		_mm256_storeu_si256((__m256i *)(next + i),
+		    _mm256_adds_epu8(_mm256_packus_epi16(e0, e1), _mm256_packus_epi16(a0, a1)));
+	}
+	passive_sse2(next, cur, i, end, kp);
+}
+#endif
+
+#ifdef HAVE_NEON
+static int
+has_neon(void)
+{
+
+#if defined(__arm__)
+	return((getauxval(AT_HWCAP) & HWCAP_NEON) != 0);
+#else
+	return(1);
+#endif
+}
+
+/*
+ * vmull_u8 gives full 16 bit products, the side radiation uses a halving
+ * add of the two products so ((l + r) * f) >> 9 can't overflow.
+ */
+static void
+passive_neon(uint8_t *next, const uint8_t *cur, int start, int end, const struct kparams_t *kp)
+{
+	const uint8x8_t hc = vdup_n_u8(kp->heat_cap);
+	const uint8x8_t sr = vdup_n_u8(kp->side_rad);
+	const uint8x8_t ur = vdup_n_u8(kp->up_rad);
+	uint8x16_t c, l, r, d;
+	uint16x8_t s0, s1, u0, u1;
+	uint8x8_t e0, e1, a0, a1;
+	int i, vend, lpl;
+
+	lpl = kp->leds_per_level;
+	vend = end < kp->numleds - 1 ? end : kp->numleds - 1;
+	for (i = start; i + 16 <= vend; i += 16) {
+		c = vld1q_u8(cur + i);
+		l = vld1q_u8(cur + i - 1);
+		r = vld1q_u8(cur + i + 1);
+		d = vld1q_u8(cur + i - lpl);
+
+		e0 = vshrn_n_u16(vmull_u8(vget_low_u8(c), hc), 8);
+		e1 = vshrn_n_u16(vmull_u8(vget_high_u8(c), hc), 8);
+		s0 = vshrq_n_u16(vhaddq_u16(vmull_u8(vget_low_u8(l), sr), vmull_u8(vget_low_u8(r), sr)), 8);
+		s1 = vshrq_n_u16(vhaddq_u16(vmull_u8(vget_high_u8(l), sr), vmull_u8(vget_high_u8(r), sr)), 8);
+		u0 = vshrq_n_u16(vmull_u8(vget_low_u8(d), ur), 8);
+		u1 = vshrq_n_u16(vmull_u8(vget_high_u8(d), ur), 8);
+		/* Narrowing keeps the low byte, same as the scalar truncation */
+		a0 = vmovn_u16(vaddq_u16(s0, u0));
+		a1 = vmovn_u16(vaddq_u16(s1, u1));
+
+		vst1q_u8(next + i, vqaddq_u8(vcombine_u8(e0, e1), vcombine_u8(a0, a1)));
+	}
+	passive_scalar(next, cur, i, end, kp);
+}
+#endif
@@ -0,0 +1,13 @@
+/* Parameters for the passive cell energy update */
+struct kparams_t {
+	int	numleds;
+	int	leds_per_level;
+	int	heat_cap;
+	int	side_rad;
+	int	up_rad;
+};
+
+void		kernel_init(void);
+int		kernel_select(const char *);
+const char	*kernel_name(void);
+void		passive_cells(uint8_t *, const uint8_t *, int, int, const struct kparams_t *);
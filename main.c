@@ -11,7 +11,6 @@
 #include <assert.h>
 #include <err.h>
 #include <getopt.h>
-#include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
 #include <pthread.h>
@@ -20,6 +19,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <sysexits.h>
 #include <sys/errno.h>
 #include <sys/queue.h>
@@ -28,6 +28,10 @@
 #include <ccan/ciniparser/ciniparser.h>
 
 #include "config.h"
+#include "kernel.h"
+#include "rt.h"
+#include "scheduler.h"
+#include "sink.h"
 #include "torch.h"
 
 /* Decl for list of clients */
@@ -42,83 +46,75 @@ struct clentry {
 
 static int doquit;
 
-static void *		thr_torch(void *arg);
-static int		opcconnect(const char *host, const char *port);
+/* Torches being driven by this process */
+static struct torch_t	**torches = NULL;
+static int		ntorches = 0;
+
+static int		addtorch(const char *name, struct config_t *conf);
 static int		createlisten(int listenport, int *listensock4, int *listensock6);
 static char *		get_ip_str(const struct sockaddr *sa, char *s, size_t maxlen);
 static struct clentry *	findsock(int fd, struct clientshead *head);
-static void		parseline(struct config_t *conf,char *cmd, const char *from);
-static void		readfromsock(struct config_t *conf, int fd, struct clientshead *head, int *numclients);
+static void		parseline(char *cmd, const char *from, int fd);
+static void		readfromsock(int fd, struct clientshead *head, int *numclients);
 static void		closesock(int fd, struct clientshead *head, int *numclients);
 
 void
 usage(const char *argv0)
 {
-	fprintf(stderr, "%s [-s server:port] [-c config]\n", argv0);
+	fprintf(stderr, "%s [-s server[,...]] -c config [-l port] [-t threads] [-R]\n", argv0);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Generate message torch to OPC server:port\n");
+	fprintf(stderr, "Up to %d servers may be given, each gets every frame, as one of\n", MAX_SERVERS);
+	fprintf(stderr, "  [tcp://]host:port[/chan]    OPC over TCP (the default)\n");
+	fprintf(stderr, "  udp://host:port[/chan]      OPC over UDP\n");
+	fprintf(stderr, "  shm://name[/chan]           shared memory ring on this machine\n");
+	fprintf(stderr, "  sacn://[host][:port][/universe]\n");
+	fprintf(stderr, "  artnet://host[:port][/universe]\n");
+	fprintf(stderr, "  rec://path                  record frames to a .opcrec file\n");
+	fprintf(stderr, "/chan sends to that OPC channel instead of torch_chan\n");
+	fprintf(stderr, "Each section of the config file (other than [global]) is a torch\n");
+	fprintf(stderr, "-R renders in real time mode (SCHED_FIFO, locked memory)\n");
 
 	exit(EX_USAGE);
 }
 
-static void *
-thr_torch(void *arg)
-{
-	static int rtn;
-	sigset_t sigs;
-
-	sigfillset(&sigs);
-	sigdelset(&sigs, SIGTERM);
-	if (pthread_sigmask(SIG_BLOCK, &sigs, NULL) != 0)
-		warn("Unable to block signals");
-
-	rtn = run_torch((struct config_t *)arg);
-
-	return(&rtn);
-}
-
+/* Connect to the OPC servers and create a torch for the given conf */
 static int
-opcconnect(const char *host, const char *port)
+addtorch(const char *name, struct config_t *conf)
 {
-	int opcsock, rtn;
-	struct addrinfo addrhint, *res, *res0;
-	char *cause;
-
-	memset(&addrhint, 0, sizeof(addrhint));
-	addrhint.ai_family = PF_UNSPEC;
-#if 1
-	addrhint.ai_socktype = SOCK_STREAM;
-	addrhint.ai_protocol = IPPROTO_TCP;
-#else
-	addrhint.ai_socktype = SOCK_DGRAM;
-	addrhint.ai_protocol = IPPROTO_UDP;
-#endif
-	if ((rtn = getaddrinfo(host, port, &addrhint, &res0)) != 0)
-		err(EX_NOHOST, "Unable to resolve host: %s", gai_strerror(rtn));
-
-	opcsock = -1;
-	cause = "";
-	for (res = res0; res; res = res->ai_next) {
-		opcsock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-		if (opcsock < 0) {
-			cause = "create socket";
-			continue;
-		}
+	struct server_t *srv;
+	struct sink_t *sink;
+	struct torch_t *torch, **tmp;
+	int i;
 
-		if (connect(opcsock, res->ai_addr, res->ai_addrlen) < 0) {
-			cause = "connect";
-			close(opcsock);
-			opcsock = -1;
-			continue;
+	/* Check a server was specified somewhere */
+	if (conf->nservers == 0) {
+		warnx("%s: A server name and port must be specified in the configuration file or on the command line", name);
+		return(-1);
+	}
+
+	if ((torch = create_torch(name, conf)) == NULL) {
+		warnx("%s: Failed to create torch", name);
+		return(-1);
+	}
+	for (i = 0; i < conf->nservers; i++) {
+		srv = &conf->servers[i];
+		if ((sink = sink_open(srv->proto, srv->host, srv->port, conf->udp_size, srv->universe)) == NULL ||
+		    add_sink(torch, sink, srv->chan) != 0) {
+			free_torch(torch);
+			return(-1);
 		}
-		break; /* Got one */
 	}
-	freeaddrinfo(res0);
 
-	if (opcsock < 0)
-		err(EX_NOHOST, "Unable to %s", cause);
+	if ((tmp = realloc(torches, sizeof(torches[0]) * (ntorches + 1))) == NULL) {
+		warnx("Unable to allocate torch list");
+		free_torch(torch);
+		return(-1);
+	}
+	torches = tmp;
+	torches[ntorches++] = torch;
 
-	return(opcsock);
+	return(0);
 }
 
 static int
@@ -212,10 +208,13 @@ findsock(int fd, struct clientshead *head)
 	return(NULL);
 }
 
+/* Run a command line from a client, replies go back on fd
+ * Commands are sent to every torch unless prefixed with @name */
 static void
-parseline(struct config_t *conf, char *cmd, const char *from)
+parseline(char *cmd, const char *from, int fd)
 {
-	char *t;
+	char *t, *line, *name;
+	int i;
 
 	t = strchr(cmd, '\n');
 	if (t != NULL)
@@ -228,12 +227,38 @@ parseline(struct config_t *conf, char *cmd, const char *from)
 		doquit = 1;
 		return;
 	}
-	cmd_torch(conf, from, cmd);
+
+	name = NULL;
+	if (cmd[0] == '@') {
+		name = cmd + 1;
+		if ((t = strchr(cmd, ' ')) == NULL) {
+			warnx("No command for %s from %s", name, from);
+			return;
+		}
+		*t = '\0';
+		cmd = t + 1;
+	}
+
+	for (i = 0; i < ntorches; i++) {
+		if (name != NULL && strcmp(name, torch_name(torches[i])))
+			continue;
+		/* cmd_torch splits the line up so give each torch its own copy */
+		if ((line = strdup(cmd)) == NULL) {
+			warnx("Unable to allocate command");
+			return;
+		}
+		cmd_torch(torches[i], from, fd, line);
+		free(line);
+		if (name != NULL)
+			return;
+	}
+	if (name != NULL)
+		warnx("No torch called %s", name);
 }
 
 /* Add data to buffer for given fd */
 static void
-readfromsock(struct config_t *conf, int fd, struct clientshead *head, int *numclients)
+readfromsock(int fd, struct clientshead *head, int *numclients)
 {
 	struct clentry *clp;
 	int amt, r;
@@ -253,7 +278,9 @@ readfromsock(struct config_t *conf, int fd, struct clientshead *head, int *numcl
 		return;
 	}
 	if (strchr(clp->buf, '\n') != NULL) {
-		parseline(conf, clp->buf, clp->addrtxt);
+		parseline(clp->buf, clp->addrtxt, fd);
+		/* A torch's rate may have changed */
+		sched_wake();
 		closesock(fd, head, numclients);
 	}
 }
@@ -278,13 +305,11 @@ closesock(int fd, struct clientshead *head, int *numclients)
 int
 main(int argc, char **argv)
 {
-	char *server = NULL;
+	char *server = NULL, *secname, *simd, *cpus;
 	const char *argv0;
-	int ch, i, j, listenport, listensock4, listensock6, opcsock, rtn;
+	int ch, i, j, listenport, listensock4, listensock6, nthreads, realtime, rtn;
 	struct config_t conf;
 	dictionary *ini;
-	pthread_t torchthr;
-	void *thrrtn;
 	struct pollfd *fds;
 	struct clentry *clp;
 	int numclients = 0;
@@ -292,6 +317,8 @@ main(int argc, char **argv)
 		{ "config",	required_argument,	NULL, 	'c' },
 		{ "listen",	required_argument,	NULL,	'l' },
 		{ "server",	required_argument,	NULL,	's' },
+		{ "threads",	required_argument,	NULL,	't' },
+		{ "realtime",	no_argument,		NULL,	'R' },
 		{ NULL,		0,			NULL,	0 }
 	};
 	struct clientshead clients = SLIST_HEAD_INITIALIZER(clients);
@@ -299,18 +326,16 @@ main(int argc, char **argv)
 	SLIST_INIT(&clients);
 	rtn = 0;
 	listenport = listensock4 = listensock6 = -1;
+	nthreads = -1;
+	realtime = -1;
 	argv0 = argv[0];
 	ini = NULL;
 
-	default_conf(&conf);
-
-	while ((ch = getopt_long(argc, argv, "c:l:s:", longopts, NULL)) != -1) {
+	while ((ch = getopt_long(argc, argv, "c:l:Rs:t:", longopts, NULL)) != -1) {
 		switch (ch) {
 			case 'c':
 				if ((ini = ciniparser_load(optarg)) == NULL)
 					exit(EX_DATAERR);
-				if (ini2conf(ini, &conf) != 0)
-					exit(EX_DATAERR);
 				break;
 
 			case 'l':
@@ -319,10 +344,20 @@ main(int argc, char **argv)
 					errx(EX_DATAERR, "Listen port out of range");
 				break;
 
+			case 'R':
+				realtime = 1;
+				break;
+
 			case 's':
 				server = optarg;
 				break;
 
+			case 't':
+				nthreads = atoi(optarg);
+				if (nthreads <= 0)
+					errx(EX_DATAERR, "Thread count must be greater than 0");
+				break;
+
 			default:
 				usage(argv0);
 		}
@@ -333,20 +368,58 @@ main(int argc, char **argv)
 	if (argc != 0)
 		usage(argv0);
 
-	/* Override the server host/port in config from the command line */
-	if (server != NULL) {
-		conf.srvport = strchr(server, ':');
-		conf.srvport[0] = '\0';
-		conf.srvport++;
-		conf.srvhost = server;
+	/* Default to one worker per CPU, the scheduler won't use more than one per torch */
+	if (nthreads == -1 && ini != NULL)
+		nthreads = ciniparser_getint(ini, "global:threads", -1);
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	/* Use the fastest flame kernel the CPU supports unless told otherwise */
+	kernel_init();
+	if (ini != NULL && (simd = ciniparser_getstring(ini, "global:simd", NULL)) != NULL) {
+		if (kernel_select(simd) != 0)
+			errx(EX_DATAERR, "SIMD kernel %s is not available", simd);
 	}
 
-	/* Check a server was specified somewhere */
-	if (conf.srvhost == NULL || conf.srvport == NULL) {
-		errx(EX_DATAERR, "A server name and port must be specified in the configuration file or on the command line\n");
+	/* Real time mode has to be set up before any threads or buffers are */
+	if (realtime == -1 && ini != NULL)
+		realtime = ciniparser_getboolean(ini, "global:realtime", 0);
+	if (realtime == 1) {
+		cpus = ini != NULL ? ciniparser_getstring(ini, "global:rt_cpus", NULL) : NULL;
+		if (rt_init(ini != NULL ? ciniparser_getint(ini, "global:rt_priority", 50) : 50, cpus,
+		    ini != NULL ? ciniparser_getboolean(ini, "global:rt_sender", 0) : 0) != 0)
+			exit(EX_DATAERR);
 	}
-	if ((opcsock = opcconnect(conf.srvhost, conf.srvport)) == -1) {
-		rtn = EX_OSERR;
+
+	/* A server or client closing the connection is noticed when writing
+	 * to it fails */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Every section other than [global] describes a torch
+	 * (ciniparser_getsecname numbers sections from 1) */
+	for (i = 1; ini != NULL && i <= ciniparser_getnsec(ini); i++) {
+		secname = ciniparser_getsecname(ini, i);
+		if (!strcmp(secname, "global"))
+			continue;
+
+		default_conf(&conf);
+		if (ini2conf(ini, secname, &conf) != 0)
+			exit(EX_DATAERR);
+		/* Override the server host/port in config from the command line */
+		if (server != NULL && (setserver(&conf, server) != 0 || checkservers(secname, &conf) != 0))
+			exit(EX_DATAERR);
+		if (addtorch(secname, &conf) != 0) {
+			rtn = EX_OSERR;
+			goto out;
+		}
+	}
+	/* Torches need at least their size from the config */
+	if (ntorches == 0) {
+		if (ini == NULL)
+			warnx("No config given, use -c to describe the torches");
+		else
+			warnx("No torch sections in the config, each section other than [global] is a torch");
+		rtn = EX_DATAERR;
 		goto out;
 	}
 
@@ -357,23 +430,21 @@ main(int argc, char **argv)
 		}
 	}
 
-	if ((rtn = create_torch(opcsock, &conf)) != 0) {
-		warnx("Failed to create: %d\n", rtn);
+	if (sched_start(torches, ntorches, nthreads) != 0) {
+		warnx("Failed to start torch threads");
 		rtn = EX_OSERR;
 		goto out;
 	}
 
-	if (pthread_create(&torchthr, NULL, &thr_torch, &conf) != 0) {
-		warnx("Failed to start thread\n");
+	/* Nothing to listen for so just wait for the workers to exit
+	 * (which only happens if every torch fails) */
+	if (listenport == -1) {
+		sched_wait();
+		warnx("Every torch has failed");
 		rtn = EX_OSERR;
 		goto out;
 	}
 
-	/* Nothing to listen for so just wait for the thread to exit
-	 * (which will never happen, so just sleep) */
-	if (listenport == -1)
-		goto wait;
-
 	fds = NULL;
 	doquit = 0;
 	while (!doquit) {
@@ -445,7 +516,7 @@ main(int argc, char **argv)
 			} else {
 				/* See if our clients have anything to say */
 				if (fds[i].revents & POLLRDNORM) {
-					readfromsock(&conf, fds[i].fd, &clients, &numclients);
+					readfromsock(fds[i].fd, &clients, &numclients);
 				}
 				if (fds[i].revents & (POLLERR | POLLHUP)) {
 					closesock(fds[i].fd, &clients, &numclients);
@@ -453,18 +524,13 @@ main(int argc, char **argv)
 			}
 		}
 	}
-	fprintf(stderr, "before\n");
-	pthread_kill(torchthr, SIGTERM);
-	fprintf(stderr, "after\n");
-
-  wait:
-	pthread_join(torchthr, &thrrtn);
-	fprintf(stderr, "Torch thread returned %p\n", thrrtn);
+	sched_stop();
 
   out:
-	free_torch();
+	for (i = 0; i < ntorches; i++)
+		free_torch(torches[i]);
+	free(torches);
 	ciniparser_freedict(ini);
-	close(opcsock);
 	close(listensock4);
 	close(listensock6);
 
@@ -0,0 +1,28 @@
+/* Layout of .opcrec files written by rec:// sinks and played by opctorch-replay
+ *
+ * A header followed by one record per frame sent, each record is the frame
+ * header and then the pixels, padded so the next record is 8 byte aligned.
+ * Records are only ever appended and the whole file can be mapped and the
+ * pixels sent straight from it.
+ *
+ * Everything is in host byte order.
+ */
+
+#define OPCREC_MAGIC	"OPCREC\0\0"
+#define OPCREC_VERSION	1
+
+struct opcrec_hdr_t {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	pad;
+};
+
+struct opcrec_frame_t {
+	uint64_t	ns;		// CLOCK_MONOTONIC time since the first frame
+	uint32_t	len;		// Bytes of pixels which follow
+	uint32_t	chunk;		// Bytes per OPC channel, 0 for as many as fit
+	uint8_t		chan;		// First OPC channel
+	uint8_t		pad[7];
+};
+
+#define OPCREC_ALIGN(len)	(((len) + 7) & ~(size_t)7)
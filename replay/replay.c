@@ -0,0 +1,193 @@
+/*
+ * Play a .opcrec recording back to OPC servers
+ *
+ * The recording is mapped and frames are sent straight from it at the rate
+ * they were recorded, or faster, so servers can be loaded harder than the
+ * simulation could manage and sinks timed without running it at all.
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+#include <ccan/ciniparser/ciniparser.h>
+
+#include "config.h"
+#include "opcrec.h"
+#include "sink.h"
+#include "torch.h"
+
+/* How long to wait for the servers before starting and for the last
+ * frames to be written at the end (ms) */
+#define CONNECT_WAIT	5000
+#define DRAIN_WAIT	5000
+
+void
+usage(const char *argv0)
+{
+	fprintf(stderr, "%s [-x speed] [-l loops] [-u udp_size] -s server[,...] file.opcrec\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Send a recording made with a rec:// server to other servers\n");
+	fprintf(stderr, "-x plays it speed times faster (0 for as fast as possible), -l 0 loops forever\n");
+
+	exit(EX_USAGE);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct config_t conf;
+	struct sink_t *sinks[MAX_SERVERS];
+	const struct opcrec_hdr_t *hdr;
+	const struct opcrec_frame_t *fr;
+	const uint8_t *map;
+	struct timespec start, base, due, now;
+	struct stat st;
+	uint64_t nframes, ns, dropped, coalesced, d, c;
+	double speed, secs;
+	size_t off;
+	char *argv0, *server;
+	int ch, chan, fd, i, loop, loops, pending, up, waited;
+
+	argv0 = argv[0];
+	server = NULL;
+	speed = 1;
+	loops = 1;
+	default_conf(&conf);
+	while ((ch = getopt(argc, argv, "l:s:u:x:")) != -1) {
+		switch (ch) {
+			case 'l':
+				if ((loops = atoi(optarg)) < 0)
+					errx(EX_DATAERR, "Loop count can't be negative");
+				break;
+
+			case 's':
+				server = optarg;
+				break;
+
+			case 'u':
+				conf.udp_size = atoi(optarg);
+				if (conf.udp_size < SINK_UDP_MIN || conf.udp_size > SINK_UDP_MAX)
+					errx(EX_DATAERR, "UDP size must be between %d and %d", SINK_UDP_MIN, SINK_UDP_MAX);
+				break;
+
+			case 'x':
+				if ((speed = strtod(optarg, NULL)) < 0)
+					errx(EX_DATAERR, "Speed can't be negative");
+				break;
+
+			default:
+				usage(argv0);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || server == NULL)
+		usage(argv0);
+	if (setserver(&conf, server) != 0 || conf.nservers == 0)
+		exit(EX_DATAERR);
+	/* A server closing the connection is noticed when sending fails */
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((fd = open(argv[0], O_RDONLY)) == -1)
+		err(EX_NOINPUT, "Unable to open %s", argv[0]);
+	if (fstat(fd, &st) == -1)
+		err(EX_OSERR, "Unable to stat %s", argv[0]);
+	if ((size_t)st.st_size < sizeof(*hdr))
+		errx(EX_DATAERR, "%s is too short to be a recording", argv[0]);
+	if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		err(EX_OSERR, "Unable to map %s", argv[0]);
+	close(fd);
+	hdr = (const struct opcrec_hdr_t *)map;
+	if (memcmp(hdr->magic, OPCREC_MAGIC, sizeof(hdr->magic)) || hdr->version != OPCREC_VERSION)
+		errx(EX_DATAERR, "%s isn't a version %d recording", argv[0], OPCREC_VERSION);
+
+	/* sACN and Art-Net take frames the size of the first one */
+	fr = (const struct opcrec_frame_t *)(map + sizeof(*hdr));
+	if (sizeof(*hdr) + sizeof(*fr) > (size_t)st.st_size)
+		errx(EX_DATAERR, "%s has no frames", argv[0]);
+
+	for (i = 0; i < conf.nservers; i++) {
+		if ((sinks[i] = sink_open(conf.servers[i].proto, conf.servers[i].host, conf.servers[i].port,
+		    conf.udp_size, conf.servers[i].universe)) == NULL)
+			exit(EX_OSERR);
+		if (sink_setframe(sinks[i], fr->len) != 0)
+			exit(EX_DATAERR);
+	}
+	/* Connecting happens in the background, give it a chance first */
+	for (waited = 0; waited < CONNECT_WAIT; waited += 10) {
+		for (i = up = 0; i < conf.nservers; i++)
+			up += sink_connected(sinks[i]);
+		if (up == conf.nservers)
+			break;
+		usleep(10000);
+	}
+
+	nframes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (loop = 0; loops == 0 || loop < loops; loop++) {
+		clock_gettime(CLOCK_MONOTONIC, &base);
+		for (off = sizeof(*hdr); off + sizeof(*fr) <= (size_t)st.st_size; off += sizeof(*fr) + OPCREC_ALIGN(fr->len)) {
+			fr = (const struct opcrec_frame_t *)(map + off);
+			if (off + sizeof(*fr) + fr->len > (size_t)st.st_size)
+				break;
+
+			if (speed > 0) {
+				ns = fr->ns / speed;
+				due = base;
+				due.tv_sec += ns / 1000000000;
+				due.tv_nsec += ns % 1000000000;
+				if (due.tv_nsec >= 1000000000) {
+					due.tv_nsec -= 1000000000;
+					due.tv_sec++;
+				}
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+			}
+
+			for (i = 0; i < conf.nservers; i++) {
+				chan = conf.servers[i].chan >= 0 ? conf.servers[i].chan : fr->chan;
+				if (sink_send(sinks[i], chan, fr + 1, fr->len, fr->chunk) != 0)
+					exit(EX_OSERR);
+			}
+			nframes++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+
+	/* Sending doesn't block, so the last frames may still be queued */
+	for (waited = 0; waited < DRAIN_WAIT; waited += 10) {
+		for (i = pending = 0; i < conf.nservers; i++) {
+			sink_poll(sinks[i]);
+			pending += sink_pending(sinks[i]);
+		}
+		if (pending == 0)
+			break;
+		usleep(10000);
+	}
+	if (pending > 0)
+		warnx("Gave up waiting for the last frames to be sent");
+
+	dropped = coalesced = 0;
+	for (i = 0; i < conf.nservers; i++) {
+		sink_stats(sinks[i], &d, &c);
+		dropped += d;
+		coalesced += c;
+		sink_close(sinks[i]);
+	}
+	printf("%llu frames in %.3fs (%.1f fps), %llu dropped, %llu coalesced\n",
+	    (unsigned long long)nframes, secs, secs > 0 ? nframes / secs : 0,
+	    (unsigned long long)dropped, (unsigned long long)coalesced);
+
+	return(0);
+}
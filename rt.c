@@ -0,0 +1,175 @@
+/* Real time mode
+ *
+ * For machines shared with other busy programs, where the worst frame
+ * matters more than the average. Threads doing the rendering (and the
+ * senders if asked) run SCHED_FIFO and may be pinned to given CPUs. All
+ * our memory is locked and the torch buffers and thread stacks are touched
+ * up front so a frame never waits on a page fault.
+ *
+ * rt_init has to be called before any torches are created, each thread
+ * then calls rt_thread as it starts to take on its settings.
+ */
+
+#define _GNU_SOURCE	// pthread_setaffinity_np
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "rt.h"
+
+/* Stack each real time thread touches when it starts */
+#define RT_STACK	(64 * 1024)
+
+static int		enabled;
+static int		prio;		// SCHED_FIFO priority of render threads, senders are one lower
+static int		sender;		// Senders are real time too
+#ifdef __linux__
+static cpu_set_t	cpus;
+#endif
+static int		pinned;		// cpus is set
+
+/* Problems are only reported by the first thread to hit them */
+static pthread_mutex_t	rt_mtx = PTHREAD_MUTEX_INITIALIZER;
+static int		warnedprio;
+static int		warnedcpus;
+
+static int	parsecpus(const char *);
+static void	touchstack(void);
+
+/* Turn on real time mode, cpulist is a comma separated list of CPUs to run
+ * on (NULL for any) */
+int
+rt_init(int priority, const char *cpulist, int rtsender)
+{
+	struct rlimit rl;
+	int max, min;
+
+	min = sched_get_priority_min(SCHED_FIFO);
+	max = sched_get_priority_max(SCHED_FIFO);
+	if (priority < min || priority > max) {
+		warnx("Real time priority must be between %d and %d", min, max);
+		return(-1);
+	}
+	prio = priority;
+	sender = rtsender;
+	if (cpulist != NULL && parsecpus(cpulist) != 0)
+		return(-1);
+
+	/* Thread stacks alone would go past a small limit once everything is
+	 * locked, then nothing more could be allocated */
+	if (geteuid() != 0 && (getrlimit(RLIMIT_MEMLOCK, &rl) == -1 || rl.rlim_cur != RLIM_INFINITY))
+		warnx("Not locking memory, RLIMIT_MEMLOCK is limited so frames may wait for paging (needs root or ulimit -l unlimited)");
+	else if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+		warn("Unable to lock memory so frames may wait for paging");
+	enabled = 1;
+
+	return(0);
+}
+
+int
+rt_enabled(void)
+{
+
+	return(enabled);
+}
+
+/* Apply the settings for role to the calling thread */
+void
+rt_thread(int role)
+{
+	struct sched_param sp;
+	int e;
+
+	if (!enabled || (role == RT_SENDER && !sender))
+		return;
+
+	memset(&sp, 0, sizeof(sp));
+	sp.sched_priority = prio;
+	if (role == RT_SENDER && prio > sched_get_priority_min(SCHED_FIFO))
+		sp.sched_priority--;
+	if ((e = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp)) != 0) {
+		assert(pthread_mutex_lock(&rt_mtx) == 0);
+		if (!warnedprio)
+			warnx("Unable to run threads SCHED_FIFO: %s (needs root, CAP_SYS_NICE or RLIMIT_RTPRIO)", strerror(e));
+		warnedprio = 1;
+		assert(pthread_mutex_unlock(&rt_mtx) == 0);
+	}
+
+#ifdef __linux__
+	if (pinned && (e = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) != 0) {
+		assert(pthread_mutex_lock(&rt_mtx) == 0);
+		if (!warnedcpus)
+			warnx("Unable to pin threads to CPUs: %s", strerror(e));
+		warnedcpus = 1;
+		assert(pthread_mutex_unlock(&rt_mtx) == 0);
+	}
+#endif
+
+	touchstack();
+}
+
+/* Fault in every page of a buffer without changing what is in it */
+void
+rt_prefault(void *buf, size_t len)
+{
+	volatile uint8_t *p = buf;
+	size_t i, pg;
+
+	if (!enabled || buf == NULL || len == 0)
+		return;
+	pg = sysconf(_SC_PAGESIZE);
+	for (i = 0; i < len; i += pg)
+		p[i] = p[i];
+	p[len - 1] = p[len - 1];
+}
+
+static int
+parsecpus(const char *cpulist)
+{
+#ifdef __linux__
+	const char *s;
+	char *end;
+	long cpu, ncpus;
+
+	ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	CPU_ZERO(&cpus);
+	for (s = cpulist; *s != '\0'; s = end) {
+		while (*s == ',' || *s == ' ')
+			s++;
+		if (*s == '\0')
+			break;
+		cpu = strtol(s, &end, 10);
+		if (end == s || cpu < 0 || cpu >= ncpus || cpu >= CPU_SETSIZE) {
+			warnx("Bad CPU in %s, CPUs are numbered 0 to %ld", cpulist, ncpus - 1);
+			return(-1);
+		}
+		CPU_SET(cpu, &cpus);
+	}
+	pinned = CPU_COUNT(&cpus) > 0;
+#else
+	warnx("Pinning threads to CPUs isn't supported here, ignoring %s", cpulist);
+#endif
+
+	return(0);
+}
+
+/* Grow the stack to what a frame might need now rather than mid frame */
+static void __attribute__((noinline))
+touchstack(void)
+{
+	volatile uint8_t stack[RT_STACK];
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += 1024)
+		stack[i] = 0;
+}
@@ -0,0 +1,8 @@
+/* Roles of threads for real time mode */
+#define RT_RENDER	0	// Scheduler workers and band threads
+#define RT_SENDER	1	// Each torch's sender thread
+
+int	rt_init(int, const char *, int);
+int	rt_enabled(void);
+void	rt_thread(int);
+void	rt_prefault(void *, size_t);
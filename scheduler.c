@@ -0,0 +1,289 @@
+/* Frame scheduler
+ *
+ * Runs any number of torches on a fixed pool of worker threads. Every torch
+ * has a deadline for its next frame, an idle worker waits for the earliest
+ * deadline of the torches nobody is rendering and only claims that torch
+ * once it is due, so a torch which becomes due sooner meanwhile (another
+ * finishing late, or a rate change) isn't held up behind it.
+ *
+ * Deadlines are on CLOCK_MONOTONIC and worked out from when the torch
+ * started (or last changed rate) rather than from the previous frame, so
+ * they don't drift however long each frame takes.
+ */
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <ccan/ciniparser/ciniparser.h>
+
+#include "config.h"
+#include "rt.h"
+#include "scheduler.h"
+#include "torch.h"
+
+/* Furthest behind a torch with catch_up set will try to catch up from (ns) */
+#define CATCHUP_MAX	1000000000ULL
+
+struct schedent_t {
+	struct torch_t	*torch;
+	struct timespec	due;	// When the next frame should be rendered
+	uint64_t	epoch;	// Frame n is due epoch + n periods (ns)
+	uint64_t	n;
+	int		rate;	// Rate the period was worked out for
+	int		busy;	// Claimed by a worker
+	int		dead;	// Failed, no longer scheduled
+};
+
+static struct schedent_t *ents = NULL;
+static int		nents;
+static int		nlive;
+static pthread_t	*workers = NULL;
+static int		nworkers;
+static int		stopping;
+
+static pthread_mutex_t	sched_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	sched_cv;	// On CLOCK_MONOTONIC, set up by sched_start
+
+static void *	thr_worker(void *arg);
+static void	nextdue(struct schedent_t *);
+static void	rerate(struct schedent_t *, int);
+static int	tscmp(const struct timespec *, const struct timespec *);
+static uint64_t	ts2ns(const struct timespec *);
+
+/* Start nthreads workers driving the given torches */
+int
+sched_start(struct torch_t **torches, int ntorches, int nthreads)
+{
+	pthread_condattr_t attr;
+	struct timespec now;
+	int i;
+
+	assert(ntorches > 0);
+	if (nthreads > ntorches)
+		nthreads = ntorches;
+	if (nthreads < 1)
+		nthreads = 1;
+
+	if ((ents = calloc(ntorches, sizeof(ents[0]))) == NULL)
+		return(-1);
+	if ((workers = calloc(nthreads, sizeof(workers[0]))) == NULL)
+		return(-1);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (i = 0; i < ntorches; i++) {
+		ents[i].torch = torches[i];
+		ents[i].due = now;
+		ents[i].epoch = ts2ns(&now);
+		ents[i].rate = torch_rate(torches[i]);
+	}
+	nents = nlive = ntorches;
+	stopping = 0;
+
+	/* Deadlines are waited for on the same clock they are worked out on */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sched_cv, &attr);
+	pthread_condattr_destroy(&attr);
+
+	for (nworkers = 0; nworkers < nthreads; nworkers++) {
+		if (pthread_create(&workers[nworkers], NULL, &thr_worker, NULL) != 0) {
+			warnx("Failed to start worker thread");
+			sched_stop();
+			return(-1);
+		}
+	}
+
+	return(0);
+}
+
+/* Wait for the workers to exit (only happens once every torch has failed) */
+void
+sched_wait(void)
+{
+	int i;
+
+	for (i = 0; i < nworkers; i++)
+		pthread_join(workers[i], NULL);
+	nworkers = 0;
+
+	free(workers);
+	workers = NULL;
+	free(ents);
+	ents = NULL;
+	pthread_cond_destroy(&sched_cv);
+}
+
+/* Ask the workers to exit and wait for them */
+void
+sched_stop(void)
+{
+
+	assert(pthread_mutex_lock(&sched_mtx) == 0);
+	stopping = 1;
+	pthread_cond_broadcast(&sched_cv);
+	assert(pthread_mutex_unlock(&sched_mtx) == 0);
+
+	sched_wait();
+}
+
+/* Have idle workers look at the deadlines again, after a command which may
+ * have changed a torch's rate */
+void
+sched_wake(void)
+{
+
+	assert(pthread_mutex_lock(&sched_mtx) == 0);
+	pthread_cond_broadcast(&sched_cv);
+	assert(pthread_mutex_unlock(&sched_mtx) == 0);
+}
+
+static void *
+thr_worker(void *arg)
+{
+	struct schedent_t *ent;
+	struct timespec now;
+	sigset_t sigs;
+	int i, rate, rtn;
+
+	/* Signals are handled by the main thread */
+	sigfillset(&sigs);
+	if (pthread_sigmask(SIG_BLOCK, &sigs, NULL) != 0)
+		warn("Unable to block signals");
+	rt_thread(RT_RENDER);
+
+	assert(pthread_mutex_lock(&sched_mtx) == 0);
+	while (!stopping && nlive > 0) {
+		ent = NULL;
+		for (i = 0; i < nents; i++) {
+			if (ents[i].busy || ents[i].dead)
+				continue;
+			if ((rate = torch_rate(ents[i].torch)) != ents[i].rate)
+				rerate(&ents[i], rate);
+			if (ent == NULL || tscmp(&ents[i].due, &ent->due) < 0)
+				ent = &ents[i];
+		}
+		if (ent == NULL) {
+			/* Every live torch has been claimed by another worker */
+			pthread_cond_wait(&sched_cv, &sched_mtx);
+			continue;
+		}
+		/* Not due yet, look again then or when something changes */
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (tscmp(&now, &ent->due) < 0) {
+			pthread_cond_timedwait(&sched_cv, &sched_mtx, &ent->due);
+			continue;
+		}
+		ent->busy = 1;
+		assert(pthread_mutex_unlock(&sched_mtx) == 0);
+
+		rtn = run_torch(ent->torch);
+		/* Nobody else looks at a busy entry */
+		if (rtn == 0)
+			nextdue(ent);
+
+		assert(pthread_mutex_lock(&sched_mtx) == 0);
+		ent->busy = 0;
+		if (rtn != 0) {
+			warnx("Torch %s failed, no longer running it", torch_name(ent->torch));
+			ent->dead = 1;
+			nlive--;
+		}
+		pthread_cond_broadcast(&sched_cv);
+	}
+	assert(pthread_mutex_unlock(&sched_mtx) == 0);
+
+	return(NULL);
+}
+
+/* Advance the deadline by one frame period
+ * If that has already gone by the frame just rendered overran and the
+ * torch is late. Then either the deadlines which were missed are skipped,
+ * staying in step with the ones before, or with catch_up they are rendered
+ * back to back until it is on time again (unless it is too far behind). */
+static void
+nextdue(struct schedent_t *ent)
+{
+	struct timespec ts;
+	uint64_t now, due, behind, n;
+	int rate;
+
+	rate = torch_rate(ent->torch);
+	if (rate <= 0)
+		rate = 1;
+	if (rate != ent->rate) {
+		/* Count from the current deadline at the new rate */
+		ent->epoch += ent->n * 1000000000ULL / ent->rate;
+		ent->n = 0;
+		ent->rate = rate;
+	}
+	/* Whole seconds are moved into the epoch to keep the sums small, a
+	 * second is exactly rate periods so nothing is lost */
+	if (++ent->n >= (uint64_t)rate) {
+		ent->epoch += ent->n / rate * 1000000000ULL;
+		ent->n %= rate;
+	}
+	due = ent->epoch + ent->n * 1000000000ULL / rate;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts2ns(&ts);
+	if (due < now) {
+		if (torch_catchup(ent->torch) && now - due <= CATCHUP_MAX)
+			torch_overrun(ent->torch, 0);
+		else {
+			/* First deadline after now */
+			behind = now - ent->epoch;
+			n = behind / 1000000000ULL * rate + behind % 1000000000ULL * rate / 1000000000ULL + 1;
+			torch_overrun(ent->torch, n - ent->n);
+			ent->epoch += n / rate * 1000000000ULL;
+			ent->n = n % rate;
+			due = ent->epoch + ent->n * 1000000000ULL / rate;
+		}
+	}
+
+	ent->due.tv_sec = due / 1000000000ULL;
+	ent->due.tv_nsec = due % 1000000000ULL;
+}
+
+/* The rate of a torch nobody is rendering has changed, its next frame is
+ * now due one period at the new rate after the last deadline (or straight
+ * away if that has gone by, the deadlines before never existed so they
+ * don't count as missed) */
+static void
+rerate(struct schedent_t *ent, int rate)
+{
+	struct timespec ts;
+	uint64_t due, now;
+
+	due = ent->epoch + ent->n * 1000000000ULL / ent->rate;
+	ent->epoch = due - 1000000000ULL / ent->rate + 1000000000ULL / rate;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if ((now = ts2ns(&ts)) > ent->epoch)
+		ent->epoch = now;
+	ent->n = 0;
+	ent->rate = rate;
+	ent->due.tv_sec = ent->epoch / 1000000000ULL;
+	ent->due.tv_nsec = ent->epoch % 1000000000ULL;
+}
+
+static int
+tscmp(const struct timespec *a, const struct timespec *b)
+{
+
+	if (a->tv_sec != b->tv_sec)
+		return(a->tv_sec < b->tv_sec ? -1 : 1);
+	if (a->tv_nsec != b->tv_nsec)
+		return(a->tv_nsec < b->tv_nsec ? -1 : 1);
+	return(0);
+}
+
+static uint64_t
+ts2ns(const struct timespec *ts)
+{
+
+	return(ts->tv_sec * 1000000000ULL + ts->tv_nsec);
+}
@@ -0,0 +1,6 @@
+struct torch_t;
+
+int	sched_start(struct torch_t **, int, int);
+void	sched_wait(void);
+void	sched_stop(void);
+void	sched_wake(void);
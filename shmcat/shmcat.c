@@ -0,0 +1,164 @@
+/*
+ * Reference reader for the shared memory ring written by shm:// sinks
+ *
+ * Follows the ring and checks every message with the seqlock without
+ * copying it, printing what it saw once a second (or every message with -v).
+ */
+
+#include <err.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+static void	readmsg(const struct shm_ring_t *ring, uint64_t n, int chan, int verbose);
+
+/* Messages seen, messages the writer lapped us on and messages which changed while being read */
+static uint64_t	nread, nmissed, ntorn;
+
+void
+usage(const char *argv0)
+{
+	fprintf(stderr, "%s [-c chan] [-n msgs] [-v] name\n", argv0);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Read OPC messages from an opctorch shm://name sink\n");
+	fprintf(stderr, "-c only counts messages for one OPC channel, -v prints every message\n");
+
+	exit(EX_USAGE);
+}
+
+/* Look at message n in place */
+static void
+readmsg(const struct shm_ring_t *ring, uint64_t n, int chan, int verbose)
+{
+	const struct shm_slot_t *slot;
+	uint64_t seq;
+	uint32_t c, len, i, sum;
+
+	slot = &ring->slots[n % ring->nslots];
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq != 2 * n + 2) {
+		nmissed++;
+		return;
+	}
+
+	c = slot->chan;
+	len = slot->len;
+	if (len > SHM_SLOT_DATA)
+		len = SHM_SLOT_DATA;
+	for (i = sum = 0; i < len; i++)
+		sum += slot->data[i];
+
+	/* Only now do we know if any of that was real */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+		ntorn++;
+		return;
+	}
+
+	if (chan != -1 && (int)c != chan)
+		return;
+	nread++;
+	if (verbose)
+		printf("msg %llu chan %u len %u sum %08x\n", (unsigned long long)n, c, len, sum);
+}
+
+int
+main(int argc, char **argv)
+{
+	const struct shm_ring_t *ring;
+	struct timespec nap, now, last;
+	struct stat st;
+	uint64_t next, msgs, nmsgs, seen;
+	char name[256], *argv0;
+	int ch, chan, fd, verbose;
+
+	argv0 = argv[0];
+	chan = -1;
+	nmsgs = 0;
+	verbose = 0;
+	while ((ch = getopt(argc, argv, "c:n:v")) != -1) {
+		switch (ch) {
+			case 'c':
+				chan = atoi(optarg);
+				if (chan < 0 || chan > 255)
+					errx(EX_USAGE, "Channel must be between 0 and 255");
+				break;
+
+			case 'n':
+				nmsgs = strtoull(optarg, NULL, 10);
+				break;
+
+			case 'v':
+				verbose = 1;
+				break;
+
+			default:
+				usage(argv0);
+				break;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage(argv0);
+
+	snprintf(name, sizeof(name), "%s%s", argv[0][0] == '/' ? "" : "/", argv[0]);
+	if ((fd = shm_open(name, O_RDONLY, 0)) == -1)
+		err(EX_NOINPUT, "Unable to open shared memory %s", name);
+	if (fstat(fd, &st) == -1)
+		err(EX_OSERR, "Unable to stat shared memory %s", name);
+	if ((size_t)st.st_size < sizeof(*ring))
+		errx(EX_DATAERR, "%s is too small to be a ring", name);
+	if ((ring = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+		err(EX_OSERR, "Unable to map shared memory %s", name);
+	close(fd);
+
+	if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+	    ring->version != SHM_VERSION || ring->slotsz != sizeof(ring->slots[0]) ||
+	    (size_t)st.st_size < SHM_RING_SIZE(ring->nslots))
+		errx(EX_DATAERR, "%s isn't a version %d ring", name, SHM_VERSION);
+
+	/* Start with the next message written */
+	next = __atomic_load_n(&ring->msgs, __ATOMIC_ACQUIRE);
+	nap.tv_sec = 0;
+	nap.tv_nsec = 500000;
+	clock_gettime(CLOCK_MONOTONIC, &last);
+	seen = 0;
+	while (nmsgs == 0 || seen < nmsgs) {
+		msgs = __atomic_load_n(&ring->msgs, __ATOMIC_ACQUIRE);
+		if (msgs < next) {
+			/* Writer started again from an empty ring */
+			next = msgs;
+		}
+		if (msgs - next > ring->nslots) {
+			nmissed += msgs - next - ring->nslots;
+			next = msgs - ring->nslots;
+		}
+		for (; next < msgs && (nmsgs == 0 || seen < nmsgs); next++, seen++)
+			readmsg(ring, next, chan, verbose);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (!verbose && now.tv_sec != last.tv_sec) {
+			printf("read %llu missed %llu torn %llu\n", (unsigned long long)nread,
+			    (unsigned long long)nmissed, (unsigned long long)ntorn);
+			fflush(stdout);
+			last = now;
+		}
+		if (next == msgs)
+			nanosleep(&nap, NULL);
+	}
+	printf("read %llu missed %llu torn %llu\n", (unsigned long long)nread,
+	    (unsigned long long)nmissed, (unsigned long long)ntorn);
+
+	return(0);
+}
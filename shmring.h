@@ -0,0 +1,40 @@
+/* Layout of the shared memory ring written by shm:// sinks
+ *
+ * The ring is a POSIX shared memory object holding a header followed by
+ * nslots slots, each holding one OPC message. A frame split over several
+ * channels takes a slot (and a message number) per channel. Message n
+ * (counting from 0) is written to slot n % nslots, while it is being
+ * written the slot's seq is 2n + 1 and once it is done seq is 2n + 2 and
+ * msgs is bumped to n + 1.
+ *
+ * A reader wanting message n checks seq is 2n + 2, uses the data in place and
+ * then checks seq again. If seq changed in between the writer lapped it and
+ * what was read can't be trusted. Nothing needs a syscall or a copy.
+ *
+ * Everything is in host byte order, the ring is only for this machine.
+ */
+
+#define SHM_MAGIC	0x5243504f	// "OPCR"
+#define SHM_VERSION	1
+#define SHM_SLOTS	8
+#define SHM_SLOT_DATA	65536		// Largest OPC message, rounded up
+
+struct shm_slot_t {
+	uint64_t	seq;		// Seqlock, odd while being written
+	uint32_t	chan;		// OPC channel
+	uint32_t	len;		// Bytes of pixel data
+	uint8_t		pad[48];	// Keep the data cache line aligned
+	uint8_t		data[SHM_SLOT_DATA];
+};
+
+struct shm_ring_t {
+	uint32_t	magic;
+	uint32_t	version;
+	uint32_t	nslots;
+	uint32_t	slotsz;		// sizeof(struct shm_slot_t)
+	uint64_t	msgs;		// Messages written so far
+	uint8_t		pad[40];	// Keep the slots cache line aligned
+	struct shm_slot_t slots[0];
+};
+
+#define SHM_RING_SIZE(n)	(sizeof(struct shm_ring_t) + (n) * sizeof(struct shm_slot_t))
@@ -0,0 +1,1167 @@
+/* Output sinks
+ *
+ * A sink is a connection to an OPC server. Torches talking to the same
+ * server share one sink (and so one connection), each torch addresses its
+ * own OPC channel. A torch may send each frame to several sinks. Frames
+ * too big for one OPC message are split over consecutive channels.
+ *
+ * Over UDP each frame goes out as one datagram, or if it is too big as a
+ * datagram per udp_size chunk addressed to consecutive channels. Sending
+ * never blocks, a frame which can't be sent straight away is dropped.
+ *
+ * TCP doesn't block either. All the messages of a frame are written with
+ * one sendmsg, whatever is left of a partly written frame is kept and
+ * finished off first so the stream stays framed, meanwhile only the newest
+ * frame for each channel is kept to go next.
+ *
+ * If the server isn't there (or goes away) frames are dropped while we try
+ * to connect again, waiting longer after each failure. The connect doesn't
+ * block and is checked on each send so torches keep running meanwhile.
+ *
+ * A shm sink doesn't talk to a server at all, each message is written into
+ * a ring in shared memory for a reader on the same machine (see shmring.h).
+ * A rec sink appends whole frames to a file with the time they were sent
+ * (see opcrec.h) so they can be played back later.
+ *
+ * sACN and Art-Net sinks split each frame into 170 pixel DMX universes
+ * starting from a given one. The packet header for each universe is built
+ * once when a torch is given the sink, after that only the sequence number
+ * changes and the pixels are sent straight from the frame with every
+ * universe going out in one sendmmsg.
+ */
+
+#define _GNU_SOURCE	// sendmmsg
+
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "opcrec.h"
+#include "shmring.h"
+#include "sink.h"
+
+#ifdef __linux__
+#include <linux/sockios.h>	// SIOCOUTQ
+#endif
+
+/* A server going away mustn't kill us with SIGPIPE, Linux has a flag for
+ * each send and the BSDs a socket option */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+struct sink_t {
+	int			proto;
+	char			*host;
+	char			*port;
+	int			sock;
+	int			udpsize;	// Largest datagram
+	int			sndbuf;		// UDP send buffer size, 0 if unknown
+	struct shm_ring_t	*ring;		// Mapped ring for shm sinks
+	int			recfd;		// File for rec sinks
+	off_t			recoff;		// End of the last whole record
+	struct timespec		recstart;	// When the first frame was recorded
+
+	/* sACN and Art-Net, one header and message per universe */
+	int			universe;	// First universe
+	int			nuniv;
+	size_t			framelen;	// Frame size the headers were built for
+	uint8_t			*hdrs;
+	struct mmsghdr		*msgs;
+	struct iovec		*iovs;		// DMX_IOVS per universe
+	struct sockaddr_in	*groups;	// Multicast group per universe, NULL if unicast
+	uint8_t			seq;
+	uint8_t			cid[16];	// sACN component ID
+
+	/* Connection state */
+	int			state;
+	struct addrinfo		*addrs;		// Resolved once and kept
+	struct addrinfo		*addr;		// Address being tried
+	struct timespec		retry;		// When to try again if down
+	int			backoff;	// ms to wait after the next failure
+	int			warned;		// Already complained about this outage
+	uint64_t		ups;		// Times the connection has come up
+
+	/* TCP bytes still to be written, always whole frames */
+	uint8_t			*out;
+	size_t			outlen;
+	size_t			outoff;
+	size_t			outsz;
+	/* Newest frame waiting for each channel while out is busy */
+	struct pending_t	*pend[256];
+	int			npend;
+
+	/* Only changed with mtx held but read without it by sink_stats, so
+	 * a stats command never waits behind a connect or a DNS lookup */
+	uint64_t		dropped;	// Frames which couldn't be sent
+	uint64_t		coalesced;	// Frames replaced by a newer one before being sent
+	int			refs;
+	pthread_mutex_t		mtx;
+	SLIST_ENTRY(sink_t)	entries;
+};
+
+struct pending_t {
+	uint8_t		*buf;
+	size_t		len;	// 0 if nothing is waiting
+	size_t		sz;
+};
+
+/* All open sinks, only modified by the main thread */
+static SLIST_HEAD(, sink_t) sinks = SLIST_HEAD_INITIALIZER(sinks);
+
+static int	ready(struct sink_t *sink);
+static void	startconnect(struct sink_t *sink);
+static void	checkconnect(struct sink_t *sink);
+static void	disconnect(struct sink_t *sink, const char *why, int error);
+static int	udpsend(struct sink_t *sink, const struct iovec *iov, int nmsgs);
+static int	udproom(struct sink_t *sink, size_t need);
+static int	tcpsend(struct sink_t *sink, const struct iovec *iov, int nmsgs, size_t total);
+static int	tcpflush(struct sink_t *sink);
+static int	tcpqueue(struct sink_t *sink, const struct iovec *iov, int nmsgs, size_t total);
+static void	iovcopy(uint8_t *dst, const struct iovec *iov, int niov, size_t skip);
+static int	shmopen(struct sink_t *sink);
+static int	recopen(struct sink_t *sink);
+static int	recsend(struct sink_t *sink, int chan, const void *pixels, size_t len, size_t chunk);
+static int	shmsend(struct sink_t *sink, const uint8_t *hdr, const uint8_t *pixels, size_t len);
+static int	dmxbuild(struct sink_t *sink, size_t len);
+static void	sacnhdr(struct sink_t *sink, uint8_t *h, int univ, size_t amt);
+static void	artnethdr(uint8_t *h, int univ, size_t amt);
+static int	dmxsend(struct sink_t *sink, const uint8_t *pixels, size_t len);
+static int	grow(uint8_t **buf, size_t *sz, size_t len);
+static size_t	chunksize(int proto, int udpsize, size_t chunk);
+
+#define SINK_NULL	-1	// proto for a sink which discards everything
+
+#define OPC_HDR		4	// Channel, command and length
+
+/* DMX universes carry 170 pixels */
+#define DMX_UNIV_BYTES	510
+#define DMX_IOVS	3	// Header, pixels and padding to an even length
+#define SACN_HDR	126
+#define SACN_SEQ	111	// Offset of the sequence number
+#define ARTNET_HDR	18
+#define ARTNET_SEQ	12
+
+/* Add to a counter sink_stats reads without the lock, called with it held */
+#define COUNT(p, n)	__atomic_store_n((p), *(p) + (n), __ATOMIC_RELAXED)
+
+/* Bytes waiting in a socket's send buffer, and what each datagram costs
+ * there beyond its data (roughly, it depends on the kernel) */
+#if defined(FIONWRITE)
+#define OUTQ		FIONWRITE
+#elif defined(SIOCOUTQ)
+#define OUTQ		SIOCOUTQ
+#endif
+#define UDP_OVERHEAD	1024
+
+#define STATE_DOWN	0	// Waiting to retry
+#define STATE_CONNECTING 1	// Non-blocking connect in progress
+#define STATE_UP	2
+
+/* Reconnect delay doubles from min to max */
+#define BACKOFF_MIN	100	// ms
+#define BACKOFF_MAX	2000
+
+/* Drive the connection along, returns 1 if frames can be sent */
+static int
+ready(struct sink_t *sink)
+{
+	struct timespec now;
+
+	if (sink->state == STATE_DOWN) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec < sink->retry.tv_sec ||
+		    (now.tv_sec == sink->retry.tv_sec && now.tv_nsec < sink->retry.tv_nsec))
+			return(0);
+		startconnect(sink);
+	}
+	if (sink->state == STATE_CONNECTING)
+		checkconnect(sink);
+
+	return(sink->state == STATE_UP);
+}
+
+/* Start connecting to the next address (or the first after a failure) */
+static void
+startconnect(struct sink_t *sink)
+{
+	struct addrinfo addrhint;
+	socklen_t len;
+	int rtn, one;
+
+	/* Multicast sACN, the address is picked per universe */
+	if (sink->proto == SINK_SACN && sink->host[0] == '\0') {
+		if ((sink->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+			disconnect(sink, "Unable to create socket", errno);
+			return;
+		}
+		if (fcntl(sink->sock, F_SETFL, fcntl(sink->sock, F_GETFL) | O_NONBLOCK) == -1)
+			warn("Unable to make socket non-blocking");
+		sink->state = STATE_UP;
+		checkconnect(sink);
+		return;
+	}
+
+	if (sink->addrs == NULL) {
+		memset(&addrhint, 0, sizeof(addrhint));
+		addrhint.ai_family = PF_UNSPEC;
+		if (sink->proto != SINK_TCP) {
+			addrhint.ai_socktype = SOCK_DGRAM;
+			addrhint.ai_protocol = IPPROTO_UDP;
+		} else {
+			addrhint.ai_socktype = SOCK_STREAM;
+			addrhint.ai_protocol = IPPROTO_TCP;
+		}
+		if ((rtn = getaddrinfo(sink->host, sink->port, &addrhint, &sink->addrs)) != 0) {
+			sink->addrs = NULL;
+			if (!sink->warned)
+				warnx("Unable to resolve %s: %s, will keep trying", sink->host, gai_strerror(rtn));
+			disconnect(sink, NULL, 0);
+			return;
+		}
+	}
+	if (sink->addr == NULL)
+		sink->addr = sink->addrs;
+
+	for (; sink->addr != NULL; sink->addr = sink->addr->ai_next) {
+		if ((sink->sock = socket(sink->addr->ai_family, sink->addr->ai_socktype, sink->addr->ai_protocol)) < 0)
+			continue;
+
+		/* Never wait for the server, frames are dropped or coalesced instead */
+		if (fcntl(sink->sock, F_SETFL, fcntl(sink->sock, F_GETFL) | O_NONBLOCK) == -1)
+			warn("Unable to make socket non-blocking");
+		/* Frames are written in one go so don't hold the end of one back */
+		one = 1;
+		if (sink->proto == SINK_TCP &&
+		    setsockopt(sink->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == -1)
+			warn("Unable to set TCP_NODELAY");
+#ifdef SO_NOSIGPIPE
+		if (setsockopt(sink->sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one)) == -1)
+			warn("Unable to set SO_NOSIGPIPE");
+#endif
+		/* To tell if there is room for a whole frame */
+		len = sizeof(sink->sndbuf);
+		if (sink->proto == SINK_UDP &&
+		    getsockopt(sink->sock, SOL_SOCKET, SO_SNDBUF, &sink->sndbuf, &len) == -1)
+			sink->sndbuf = 0;
+		/* Art-Net is usually broadcast */
+		if (sink->proto == SINK_ARTNET &&
+		    setsockopt(sink->sock, SOL_SOCKET, SO_BROADCAST, &one, sizeof(one)) == -1)
+			warn("Unable to set SO_BROADCAST");
+
+		if (connect(sink->sock, sink->addr->ai_addr, sink->addr->ai_addrlen) == 0) {
+			sink->state = STATE_UP;
+			break;
+		}
+		if (errno == EINPROGRESS) {
+			sink->state = STATE_CONNECTING;
+			return;
+		}
+		close(sink->sock);
+		sink->sock = -1;
+	}
+
+	if (sink->addr == NULL)
+		disconnect(sink, "Unable to connect", errno);
+	else
+		checkconnect(sink);
+}
+
+/* See if a connect has finished, moving on to the next address if it failed */
+static void
+checkconnect(struct sink_t *sink)
+{
+	struct pollfd pfd;
+	socklen_t len;
+	int error;
+
+	if (sink->state == STATE_CONNECTING) {
+		pfd.fd = sink->sock;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, 0) == 0)
+			return;
+		len = sizeof(error);
+		if (getsockopt(sink->sock, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+			error = errno;
+		if (error != 0) {
+			close(sink->sock);
+			sink->sock = -1;
+			sink->state = STATE_DOWN;
+			if ((sink->addr = sink->addr->ai_next) == NULL)
+				disconnect(sink, "Unable to connect", error);
+			else
+				startconnect(sink);
+			return;
+		}
+		sink->state = STATE_UP;
+	}
+
+	if (sink->warned)
+		warnx("Connected to %s:%s", sink->host, sink->port);
+	sink->warned = 0;
+	sink->ups++;
+	sink->backoff = BACKOFF_MIN;
+	sink->addr = NULL;
+}
+
+/* Give up on the connection (if any) and schedule another go, anything
+ * waiting to be sent is lost */
+static void
+disconnect(struct sink_t *sink, const char *why, int error)
+{
+
+	if (why != NULL && !sink->warned)
+		warnx("%s to %s:%s: %s, will keep trying", why, sink->host, sink->port, strerror(error));
+	sink->warned = 1;
+
+	if (sink->sock != -1)
+		close(sink->sock);
+	sink->sock = -1;
+	sink->state = STATE_DOWN;
+	sink->addr = NULL;
+
+	if (sink->outlen > 0)
+		COUNT(&sink->dropped, 1);
+	COUNT(&sink->dropped, sink->npend);
+	sink->outlen = sink->outoff = 0;
+	for (sink->npend = 0; sink->npend < 256; sink->npend++) {
+		if (sink->pend[sink->npend] != NULL)
+			sink->pend[sink->npend]->len = 0;
+	}
+	sink->npend = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &sink->retry);
+	sink->retry.tv_sec += sink->backoff / 1000;
+	sink->retry.tv_nsec += (sink->backoff % 1000) * 1000000;
+	if (sink->retry.tv_nsec >= 1000000000) {
+		sink->retry.tv_nsec -= 1000000000;
+		sink->retry.tv_sec++;
+	}
+	sink->backoff *= 2;
+	if (sink->backoff > BACKOFF_MAX)
+		sink->backoff = BACKOFF_MAX;
+}
+
+/* Return a sink for host:port, connecting if we don't already have one
+ * udpsize is only used by the first torch to open a UDP sink, universe is
+ * the first sACN or Art-Net universe (-1 for the default) */
+struct sink_t *
+sink_open(int proto, const char *host, const char *port, int udpsize, int universe)
+{
+	struct sink_t *sink;
+	struct timespec now;
+	int i;
+
+	if (universe == -1)
+		universe = proto == SINK_SACN ? 1 : 0;
+	SLIST_FOREACH(sink, &sinks, entries) {
+		if (sink->proto == proto && !strcmp(sink->host, host) && !strcmp(sink->port, port) &&
+		    sink->universe == universe) {
+			sink->refs++;
+			return(sink);
+		}
+	}
+
+	if ((sink = calloc(1, sizeof(*sink))) == NULL) {
+		warnx("Unable to allocate sink");
+		return(NULL);
+	}
+	if ((sink->host = strdup(host)) == NULL ||
+	    (sink->port = strdup(port)) == NULL) {
+		warnx("Unable to allocate sink");
+		goto err;
+	}
+	sink->proto = proto;
+	sink->udpsize = udpsize;
+	sink->universe = universe;
+	sink->sock = -1;
+	sink->recfd = -1;
+	sink->backoff = BACKOFF_MIN;
+	pthread_mutex_init(&sink->mtx, NULL);
+	sink->refs = 1;
+	if (proto == SINK_SACN) {
+		/* Only has to be different from any other sender on the network */
+		clock_gettime(CLOCK_REALTIME, &now);
+		for (i = 0; i < (int)sizeof(sink->cid); i++)
+			sink->cid[i] = (now.tv_nsec >> (i % 4 * 8)) ^ (getpid() >> (i % 2 * 8)) ^ (i * 37);
+		sink->cid[6] = (sink->cid[6] & 0x0f) | 0x40;	// Version 4 UUID
+		sink->cid[8] = (sink->cid[8] & 0x3f) | 0x80;
+	}
+	if (proto == SINK_SHM || proto == SINK_REC) {
+		if ((proto == SINK_SHM ? shmopen(sink) : recopen(sink)) != 0)
+			goto err;
+		sink->state = STATE_UP;
+		SLIST_INSERT_HEAD(&sinks, sink, entries);
+		return(sink);
+	}
+	SLIST_INSERT_HEAD(&sinks, sink, entries);
+
+	/* Get going now, carries on in the background if the server isn't there */
+	startconnect(sink);
+
+	return(sink);
+
+  err:
+	pthread_mutex_destroy(&sink->mtx);
+	free(sink->host);
+	free(sink->port);
+	free(sink);
+	return(NULL);
+}
+
+/* Return a sink which throws frames away, for benchmarking
+ * These aren't shared or put on the list of sinks */
+struct sink_t *
+sink_null(void)
+{
+	struct sink_t *sink;
+
+	if ((sink = calloc(1, sizeof(*sink))) == NULL) {
+		warnx("Unable to allocate sink");
+		return(NULL);
+	}
+	if ((sink->host = strdup("null")) == NULL ||
+	    (sink->port = strdup("")) == NULL) {
+		warnx("Unable to allocate sink");
+		free(sink->host);
+		free(sink);
+		return(NULL);
+	}
+	sink->proto = SINK_NULL;
+	sink->sock = -1;
+	pthread_mutex_init(&sink->mtx, NULL);
+	sink->refs = 1;
+
+	return(sink);
+}
+
+/* Tell the sink how many bytes each frame will be, for sACN and Art-Net
+ * the universe headers are built now. Torches of different sizes can't
+ * share a DMX sink as the headers only suit one size. */
+int
+sink_setframe(struct sink_t *sink, size_t len)
+{
+	int rtn;
+
+	if (sink->proto != SINK_SACN && sink->proto != SINK_ARTNET)
+		return(0);
+
+	assert(pthread_mutex_lock(&sink->mtx) == 0);
+	rtn = 0;
+	if (sink->framelen == 0)
+		rtn = dmxbuild(sink, len);
+	else if (sink->framelen != len) {
+		warnx("%s:%s: already sending %zu byte frames, can't share it with %zu byte ones",
+		    sink->host, sink->port, sink->framelen, len);
+		rtn = -1;
+	}
+	assert(pthread_mutex_unlock(&sink->mtx) == 0);
+
+	return(rtn);
+}
+
+/* Send len bytes of pixels starting at an OPC channel, the headers are
+ * added here so the same pixels can go to several sinks on different
+ * channels. Frames bigger than chunk bytes (or than fit in one message or
+ * datagram) are split over consecutive channels and all go out together. */
+int
+sink_send(struct sink_t *sink, int chan, const void *pixels, size_t len, size_t chunk)
+{
+	uint8_t hdrs[SINK_MAXMSGS][OPC_HDR];
+	struct iovec iov[2 * SINK_MAXMSGS];
+	size_t off, amt;
+	int m, n, rtn;
+
+	if (sink->proto == SINK_NULL)
+		return(0);
+
+	chunk = chunksize(sink->proto, sink->udpsize, chunk);
+	for (n = 0, off = 0; off < len; n++, off += amt) {
+		if (chan + n > 255) {
+			warnx("%s:%s: frame needs more channels than there are after %d", sink->host, sink->port, chan);
+			return(-1);
+		}
+		amt = len - off < chunk ? len - off : chunk;
+		hdrs[n][0] = chan + n;
+		hdrs[n][1] = 0; // Command: set LEDs
+		hdrs[n][2] = amt >> 8; // Length MSB
+		hdrs[n][3] = amt & 0xff; // Length LSB
+		iov[2 * n].iov_base = hdrs[n];
+		iov[2 * n].iov_len = sizeof(hdrs[n]);
+		iov[2 * n + 1].iov_base = (uint8_t *)pixels + off;
+		iov[2 * n + 1].iov_len = amt;
+	}
+
+	assert(pthread_mutex_lock(&sink->mtx) == 0);
+	rtn = 0;
+	if (sink->proto == SINK_REC)
+		rtn = recsend(sink, chan, pixels, len, chunk);
+	else if (sink->proto == SINK_SHM) {
+		for (m = 0; m < n; m++)
+			shmsend(sink, iov[2 * m].iov_base, iov[2 * m + 1].iov_base, iov[2 * m + 1].iov_len);
+	} else if (!ready(sink))
+		COUNT(&sink->dropped, 1);
+	else if (sink->proto == SINK_UDP)
+		rtn = udpsend(sink, iov, n);
+	else if (sink->proto == SINK_SACN || sink->proto == SINK_ARTNET)
+		rtn = dmxsend(sink, pixels, len);
+	else
+		rtn = tcpsend(sink, iov, n, len + n * sizeof(hdrs[0]));
+	assert(pthread_mutex_unlock(&sink->mtx) == 0);
+
+	return(rtn);
+}
+
+/* How many OPC messages (each to the next channel) a frame of len bytes is
+ * split into, or for sACN and Art-Net how many universes */
+int
+sink_nmsgs(int proto, int udpsize, size_t len, size_t chunk)
+{
+
+	if (proto == SINK_SACN || proto == SINK_ARTNET)
+		return((len + DMX_UNIV_BYTES - 1) / DMX_UNIV_BYTES);
+	chunk = chunksize(proto, udpsize, chunk);
+	return((len + chunk - 1) / chunk);
+}
+
+/* Most pixel bytes to put in each OPC message */
+static size_t
+chunksize(int proto, int udpsize, size_t chunk)
+{
+
+	if (chunk == 0 || chunk > SINK_OPC_MAX)
+		chunk = SINK_OPC_MAX;
+	/* Whole pixels per datagram */
+	if (proto == SINK_UDP && chunk > ((udpsize - OPC_HDR) / 3) * 3)
+		chunk = ((udpsize - OPC_HDR) / 3) * 3;
+
+	return(chunk);
+}
+
+/* Send a frame's OPC messages over TCP in one go, called with the sink locked */
+static int
+tcpsend(struct sink_t *sink, const struct iovec *iov, int nmsgs, size_t total)
+{
+	struct msghdr msg;
+	ssize_t amt;
+
+	if (tcpflush(sink) != 0)
+		return(-1);
+	if (sink->state != STATE_UP) {
+		COUNT(&sink->dropped, 1);
+		return(0);
+	}
+
+	/* Still backed up, wait behind what is already there */
+	if (sink->outlen > 0)
+		return(tcpqueue(sink, iov, nmsgs, total));
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = 2 * nmsgs;
+	if ((amt = sendmsg(sink->sock, &msg, MSG_NOSIGNAL)) < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			disconnect(sink, "Lost connection", errno);
+			COUNT(&sink->dropped, 1);
+			return(0);
+		}
+		amt = 0;
+	}
+	if ((size_t)amt == total)
+		return(0);
+
+	/* Keep the rest to finish off before anything else */
+	if (grow(&sink->out, &sink->outsz, total - amt) != 0) {
+		warnx("Unable to allocate output buffer");
+		return(-1);
+	}
+	iovcopy(sink->out, iov, 2 * nmsgs, amt);
+	sink->outlen = total - amt;
+	sink->outoff = 0;
+
+	return(0);
+}
+
+/* Write as much of the outstanding data as the socket will take, moving
+ * waiting frames in whenever it empties. Only fails if out of memory, a
+ * socket error disconnects. */
+static int
+tcpflush(struct sink_t *sink)
+{
+	struct pending_t *p;
+	ssize_t amt;
+	int c;
+
+	while (sink->outlen > 0) {
+		if ((amt = send(sink->sock, sink->out + sink->outoff, sink->outlen - sink->outoff, MSG_NOSIGNAL)) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				disconnect(sink, "Lost connection", errno);
+			return(0);
+		}
+		sink->outoff += amt;
+		if (sink->outoff < sink->outlen)
+			continue;
+
+		sink->outlen = sink->outoff = 0;
+		for (c = 0; c < 256 && sink->npend > 0; c++) {
+			if ((p = sink->pend[c]) == NULL || p->len == 0)
+				continue;
+			if (grow(&sink->out, &sink->outsz, sink->outlen + p->len) != 0) {
+				warnx("Unable to allocate output buffer");
+				return(-1);
+			}
+			memcpy(sink->out + sink->outlen, p->buf, p->len);
+			sink->outlen += p->len;
+			p->len = 0;
+			sink->npend--;
+		}
+	}
+
+	return(0);
+}
+
+/* Keep a frame to send once the socket catches up, replacing any older one
+ * for the same (first) channel */
+static int
+tcpqueue(struct sink_t *sink, const struct iovec *iov, int nmsgs, size_t total)
+{
+	struct pending_t *p;
+	int chan;
+
+	chan = ((const uint8_t *)iov[0].iov_base)[0];
+	if ((p = sink->pend[chan]) == NULL) {
+		if ((p = calloc(1, sizeof(*p))) == NULL) {
+			warnx("Unable to allocate pending frame");
+			return(-1);
+		}
+		sink->pend[chan] = p;
+	}
+	if (grow(&p->buf, &p->sz, total) != 0) {
+		warnx("Unable to allocate pending frame");
+		return(-1);
+	}
+	if (p->len > 0)
+		COUNT(&sink->coalesced, 1);
+	else
+		sink->npend++;
+	iovcopy(p->buf, iov, 2 * nmsgs, 0);
+	p->len = total;
+
+	return(0);
+}
+
+/* Copy everything in iov after the first skip bytes to dst */
+static void
+iovcopy(uint8_t *dst, const struct iovec *iov, int niov, size_t skip)
+{
+	int i;
+
+	for (i = 0; i < niov; i++) {
+		if (skip >= iov[i].iov_len) {
+			skip -= iov[i].iov_len;
+			continue;
+		}
+		memcpy(dst, (const uint8_t *)iov[i].iov_base + skip, iov[i].iov_len - skip);
+		dst += iov[i].iov_len - skip;
+		skip = 0;
+	}
+}
+
+/* Make sure buf can hold len bytes */
+static int
+grow(uint8_t **buf, size_t *sz, size_t len)
+{
+	uint8_t *tmp;
+
+	if (len <= *sz)
+		return(0);
+	if ((tmp = realloc(*buf, len)) == NULL)
+		return(-1);
+	*buf = tmp;
+	*sz = len;
+
+	return(0);
+}
+
+/* Send each OPC message as a datagram, called with the sink locked
+ * A frame split over several datagrams only goes if the send buffer has
+ * room for all of them, so the server doesn't get part of one. A frame
+ * which would block (or is refused because nothing is listening) is
+ * dropped, the next one will be along shortly. */
+static int
+udpsend(struct sink_t *sink, const struct iovec *iov, int nmsgs)
+{
+	struct mmsghdr msgs[SINK_MAXMSGS];
+	size_t need;
+	int m, rtn;
+
+	memset(msgs, 0, nmsgs * sizeof(msgs[0]));
+	need = 0;
+	for (m = 0; m < nmsgs; m++) {
+		msgs[m].msg_hdr.msg_iov = (struct iovec *)&iov[2 * m];
+		msgs[m].msg_hdr.msg_iovlen = 2;
+		/* The kernel takes the last one as long as the buffer isn't full */
+		if (m < nmsgs - 1)
+			need += iov[2 * m].iov_len + iov[2 * m + 1].iov_len + UDP_OVERHEAD;
+	}
+	if (nmsgs > 1 && !udproom(sink, need)) {
+		COUNT(&sink->dropped, 1);
+		return(0);
+	}
+
+	if ((rtn = sendmmsg(sink->sock, msgs, nmsgs, MSG_DONTWAIT)) < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == ECONNREFUSED) {
+			COUNT(&sink->dropped, 1);
+			return(0);
+		}
+		disconnect(sink, "Unable to send", errno);
+		COUNT(&sink->dropped, 1);
+		return(0);
+	}
+	/* Only if the estimate of the room needed was short */
+	if (rtn < nmsgs)
+		COUNT(&sink->dropped, 1);
+
+	return(0);
+}
+
+/* Returns 0 if the send buffer hasn't room for need more bytes, 1 if it
+ * has or there is no telling */
+static int
+udproom(struct sink_t *sink, size_t need)
+{
+#ifdef OUTQ
+	int queued;
+
+	if (sink->sndbuf > 0 && ioctl(sink->sock, OUTQ, &queued) == 0 &&
+	    (size_t)queued + need >= (size_t)sink->sndbuf)
+		return(0);
+#endif
+
+	return(1);
+}
+
+/* Create (or reuse) the shared memory ring named by host
+ * A ring left by an earlier run is kept so readers see frames carry on from
+ * where they were rather than starting again. */
+static int
+shmopen(struct sink_t *sink)
+{
+	struct shm_ring_t *ring;
+	struct stat st;
+	char name[256];
+	size_t sz;
+	int fd;
+
+	snprintf(name, sizeof(name), "%s%s", sink->host[0] == '/' ? "" : "/", sink->host);
+	if ((fd = shm_open(name, O_RDWR | O_CREAT, 0644)) == -1) {
+		warn("Unable to open shared memory %s", name);
+		return(-1);
+	}
+	sz = SHM_RING_SIZE(SHM_SLOTS);
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size != sz) {
+		if (ftruncate(fd, sz) == -1) {
+			warn("Unable to size shared memory %s", name);
+			close(fd);
+			return(-1);
+		}
+	}
+	ring = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED) {
+		warn("Unable to map shared memory %s", name);
+		return(-1);
+	}
+
+	if (ring->magic != SHM_MAGIC || ring->version != SHM_VERSION ||
+	    ring->nslots != SHM_SLOTS || ring->slotsz != sizeof(ring->slots[0])) {
+		memset(ring, 0, sizeof(*ring));
+		ring->version = SHM_VERSION;
+		ring->nslots = SHM_SLOTS;
+		ring->slotsz = sizeof(ring->slots[0]);
+		/* Magic goes last so a reader never sees a half set up header */
+		__atomic_store_n(&ring->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+	sink->ring = ring;
+
+	return(0);
+}
+
+/* Write a frame into the next slot of the ring, called with the sink locked
+ * Readers never hold us up, if one is too slow it gets lapped. */
+static int
+shmsend(struct sink_t *sink, const uint8_t *hdr, const uint8_t *pixels, size_t len)
+{
+	struct shm_ring_t *ring = sink->ring;
+	struct shm_slot_t *slot;
+	uint64_t n;
+
+	n = ring->msgs;
+	slot = &ring->slots[n % ring->nslots];
+
+	/* Mark the slot busy before touching the data */
+	__atomic_store_n(&slot->seq, 2 * n + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->chan = hdr[0];
+	slot->len = len;
+	memcpy(slot->data, pixels, len);
+	__atomic_store_n(&slot->seq, 2 * n + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->msgs, n + 1, __ATOMIC_RELEASE);
+
+	return(0);
+}
+
+/* Start a new recording in the file named by host */
+static int
+recopen(struct sink_t *sink)
+{
+	struct opcrec_hdr_t hdr;
+
+	if ((sink->recfd = open(sink->host, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) == -1) {
+		warn("Unable to create %s", sink->host);
+		return(-1);
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, OPCREC_MAGIC, sizeof(hdr.magic));
+	hdr.version = OPCREC_VERSION;
+	if (write(sink->recfd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		warn("Unable to write to %s", sink->host);
+		close(sink->recfd);
+		sink->recfd = -1;
+		return(-1);
+	}
+	sink->recoff = sizeof(hdr);
+
+	return(0);
+}
+
+/* Append a frame to the recording, called with the sink locked
+ * A record which can't be written in full is cut off again so the file
+ * stays readable, the frame is counted as dropped. */
+static int
+recsend(struct sink_t *sink, int chan, const void *pixels, size_t len, size_t chunk)
+{
+	static const uint8_t zeros[8];
+	struct opcrec_frame_t fr;
+	struct timespec now;
+	struct iovec iov[3];
+	ssize_t total;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (sink->recoff == sizeof(struct opcrec_hdr_t))
+		sink->recstart = now;
+
+	memset(&fr, 0, sizeof(fr));
+	fr.ns = (now.tv_sec - sink->recstart.tv_sec) * 1000000000LL + now.tv_nsec - sink->recstart.tv_nsec;
+	fr.len = len;
+	fr.chunk = chunk;
+	fr.chan = chan;
+	iov[0].iov_base = &fr;
+	iov[0].iov_len = sizeof(fr);
+	iov[1].iov_base = (void *)pixels;
+	iov[1].iov_len = len;
+	iov[2].iov_base = (void *)zeros;
+	iov[2].iov_len = OPCREC_ALIGN(len) - len;
+	total = sizeof(fr) + OPCREC_ALIGN(len);
+
+	if (writev(sink->recfd, iov, 3) != total) {
+		if (!sink->warned)
+			warn("Unable to write to %s, dropping frames", sink->host);
+		sink->warned = 1;
+		COUNT(&sink->dropped, 1);
+		if (ftruncate(sink->recfd, sink->recoff) == -1)
+			return(-1);
+		return(0);
+	}
+	if (sink->warned)
+		warnx("Writing to %s again", sink->host);
+	sink->warned = 0;
+	sink->recoff += total;
+
+	return(0);
+}
+
+/* Build the header and message for each universe a frame of len bytes needs */
+static int
+dmxbuild(struct sink_t *sink, size_t len)
+{
+	static const uint8_t pad = 0;
+	struct msghdr *msg;
+	struct iovec *iov;
+	size_t hlen, amt;
+	int u, univ, maxuniv;
+
+	free(sink->hdrs);
+	free(sink->msgs);
+	free(sink->iovs);
+	free(sink->groups);
+	sink->hdrs = NULL;
+	sink->msgs = NULL;
+	sink->iovs = NULL;
+	sink->groups = NULL;
+	sink->framelen = 0;
+
+	hlen = sink->proto == SINK_SACN ? SACN_HDR : ARTNET_HDR;
+	maxuniv = sink->proto == SINK_SACN ? SINK_SACN_MAXUNIV : SINK_ARTNET_MAXUNIV;
+	sink->nuniv = (len + DMX_UNIV_BYTES - 1) / DMX_UNIV_BYTES;
+	if (sink->universe + sink->nuniv - 1 > maxuniv) {
+		warnx("%s:%s: frame needs %d universes from %d, past the last universe", sink->host,
+		    sink->port, sink->nuniv, sink->universe);
+		return(-1);
+	}
+	if ((sink->hdrs = calloc(sink->nuniv, hlen)) == NULL ||
+	    (sink->msgs = calloc(sink->nuniv, sizeof(sink->msgs[0]))) == NULL ||
+	    (sink->iovs = calloc(sink->nuniv * DMX_IOVS, sizeof(sink->iovs[0]))) == NULL) {
+		warnx("Unable to allocate universe headers");
+		return(-1);
+	}
+	if (sink->proto == SINK_SACN && sink->host[0] == '\0' &&
+	    (sink->groups = calloc(sink->nuniv, sizeof(sink->groups[0]))) == NULL) {
+		warnx("Unable to allocate universe headers");
+		return(-1);
+	}
+
+	for (u = 0; u < sink->nuniv; u++) {
+		univ = sink->universe + u;
+		amt = len - u * DMX_UNIV_BYTES;
+		if (amt > DMX_UNIV_BYTES)
+			amt = DMX_UNIV_BYTES;
+		if (sink->proto == SINK_SACN)
+			sacnhdr(sink, sink->hdrs + u * hlen, univ, amt);
+		else
+			artnethdr(sink->hdrs + u * hlen, univ, amt);
+
+		/* The pixels are filled in for each frame */
+		iov = &sink->iovs[u * DMX_IOVS];
+		iov[0].iov_base = sink->hdrs + u * hlen;
+		iov[0].iov_len = hlen;
+		iov[1].iov_len = amt;
+		iov[2].iov_base = (void *)&pad;
+		iov[2].iov_len = sink->proto == SINK_ARTNET ? amt & 1 : 0;
+
+		msg = &sink->msgs[u].msg_hdr;
+		msg->msg_iov = iov;
+		msg->msg_iovlen = iov[2].iov_len > 0 ? 3 : 2;
+		if (sink->groups != NULL) {
+			/* 239.255.<universe high>.<universe low> */
+			sink->groups[u].sin_family = AF_INET;
+			sink->groups[u].sin_port = htons(atoi(sink->port));
+			sink->groups[u].sin_addr.s_addr = htonl(0xefff0000 | univ);
+			msg->msg_name = &sink->groups[u];
+			msg->msg_namelen = sizeof(sink->groups[u]);
+		}
+	}
+	sink->framelen = len;
+
+	return(0);
+}
+
+/* E1.31 root, framing and DMP layers for amt bytes of slots */
+static void
+sacnhdr(struct sink_t *sink, uint8_t *h, int univ, size_t amt)
+{
+	static const uint8_t acnid[12] = "ASC-E1.17\0\0\0";
+	size_t len;
+
+	len = SACN_HDR + amt;
+	/* Root layer */
+	h[0] = 0x00; h[1] = 0x10;			// Preamble size
+	memcpy(h + 4, acnid, sizeof(acnid));
+	h[16] = 0x70 | ((len - 16) >> 8); h[17] = (len - 16) & 0xff;
+	h[21] = 0x04;					// VECTOR_ROOT_E131_DATA
+	memcpy(h + 22, sink->cid, sizeof(sink->cid));
+	/* Framing layer */
+	h[38] = 0x70 | ((len - 38) >> 8); h[39] = (len - 38) & 0xff;
+	h[43] = 0x02;					// VECTOR_E131_DATA_PACKET
+	strncpy((char *)h + 44, "opctorch", 64);	// Source name
+	h[108] = 100;					// Priority
+	h[113] = univ >> 8; h[114] = univ & 0xff;
+	/* DMP layer */
+	h[115] = 0x70 | ((len - 115) >> 8); h[116] = (len - 115) & 0xff;
+	h[117] = 0x02;					// VECTOR_DMP_SET_PROPERTY
+	h[118] = 0xa1;					// Address and data type
+	h[122] = 0x01;					// Address increment
+	h[123] = (amt + 1) >> 8; h[124] = (amt + 1) & 0xff;	// Start code and slots
+}
+
+/* ArtDmx for amt bytes of slots, padded to an even length */
+static void
+artnethdr(uint8_t *h, int univ, size_t amt)
+{
+
+	amt += amt & 1;
+	memcpy(h, "Art-Net", 8);
+	h[8] = 0x00; h[9] = 0x50;			// OpDmx, little endian
+	h[11] = 14;					// Protocol version
+	h[14] = univ & 0xff;				// SubUni
+	h[15] = (univ >> 8) & 0x7f;			// Net
+	h[16] = amt >> 8; h[17] = amt & 0xff;
+}
+
+/* Send a frame as one packet per universe, called with the sink locked
+ * As for UDP anything which can't go straight away is dropped, as is a
+ * frame of a different size to the one sink_setframe was given. */
+static int
+dmxsend(struct sink_t *sink, const uint8_t *pixels, size_t len)
+{
+	size_t hlen, seqoff;
+	int u, sent, rtn;
+
+	if (len != sink->framelen) {
+		COUNT(&sink->dropped, 1);
+		return(0);
+	}
+
+	hlen = sink->proto == SINK_SACN ? SACN_HDR : ARTNET_HDR;
+	seqoff = sink->proto == SINK_SACN ? SACN_SEQ : ARTNET_SEQ;
+	/* Art-Net uses 0 to mean there is no sequence */
+	if (++sink->seq == 0 && sink->proto == SINK_ARTNET)
+		sink->seq = 1;
+	for (u = 0; u < sink->nuniv; u++) {
+		sink->hdrs[u * hlen + seqoff] = sink->seq;
+		sink->iovs[u * DMX_IOVS + 1].iov_base = (void *)(pixels + u * DMX_UNIV_BYTES);
+	}
+
+	for (sent = 0; sent < sink->nuniv; sent += rtn) {
+		if ((rtn = sendmmsg(sink->sock, sink->msgs + sent, sink->nuniv - sent, MSG_DONTWAIT)) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS || errno == ECONNREFUSED) {
+				COUNT(&sink->dropped, 1);
+				return(0);
+			}
+			disconnect(sink, "Unable to send", errno);
+			COUNT(&sink->dropped, 1);
+			return(0);
+		}
+	}
+
+	return(0);
+}
+
+/* Returns 1 if frames sent now will go somewhere, drives connecting along */
+int
+sink_connected(struct sink_t *sink)
+{
+	int rtn;
+
+	if (sink->proto == SINK_NULL)
+		return(1);
+	assert(pthread_mutex_lock(&sink->mtx) == 0);
+	rtn = ready(sink);
+	assert(pthread_mutex_unlock(&sink->mtx) == 0);
+
+	return(rtn);
+}
+
+/* Drive the connection along and write out whatever is left of earlier
+ * frames without sending another, for when a frame is being held back.
+ * Returns how many times the sink has connected so the caller can tell if
+ * it has come back since it last looked. */
+uint64_t
+sink_poll(struct sink_t *sink)
+{
+	struct pollfd pfd;
+	uint64_t ups;
+	ssize_t amt;
+	uint8_t c;
+
+	if (sink->proto == SINK_NULL)
+		return(0);
+	assert(pthread_mutex_lock(&sink->mtx) == 0);
+	if (ready(sink) && sink->proto == SINK_TCP) {
+		tcpflush(sink);
+		/* Servers never send anything, so with nothing being written
+		 * the only sign of them going away is the socket reading EOF */
+		pfd.fd = sink->sock;
+		pfd.events = POLLIN;
+		if (sink->state == STATE_UP && poll(&pfd, 1, 0) == 1) {
+			if ((amt = recv(sink->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT)) == 0)
+				disconnect(sink, "Lost connection", EPIPE);
+			else if (amt < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+				disconnect(sink, "Lost connection", errno);
+		}
+	}
+	ups = sink->ups;
+	assert(pthread_mutex_unlock(&sink->mtx) == 0);
+
+	return(ups);
+}
+
+/* Returns 1 if frames are still waiting to be written, sink_poll writes
+ * them out */
+int
+sink_pending(struct sink_t *sink)
+{
+	int rtn;
+
+	if (sink->proto != SINK_TCP)
+		return(0);
+	assert(pthread_mutex_lock(&sink->mtx) == 0);
+	rtn = sink->outlen > 0 || sink->npend > 0;
+	assert(pthread_mutex_unlock(&sink->mtx) == 0);
+
+	return(rtn);
+}
+
+/* Number of frames which were dropped and which were replaced by a newer
+ * one before they could be sent, doesn't wait for the sink */
+void
+sink_stats(struct sink_t *sink, uint64_t *dropped, uint64_t *coalesced)
+{
+
+	*dropped = __atomic_load_n(&sink->dropped, __ATOMIC_RELAXED);
+	*coalesced = __atomic_load_n(&sink->coalesced, __ATOMIC_RELAXED);
+}
+
+void
+sink_close(struct sink_t *sink)
+{
+	int c;
+
+	if (sink == NULL || --sink->refs > 0)
+		return;
+
+	if (sink->proto != SINK_NULL)
+		SLIST_REMOVE(&sinks, sink, sink_t, entries);
+	if (sink->sock != -1)
+		close(sink->sock);
+	if (sink->addrs != NULL)
+		freeaddrinfo(sink->addrs);
+	if (sink->ring != NULL)
+		munmap(sink->ring, SHM_RING_SIZE(sink->ring->nslots));
+	if (sink->recfd != -1)
+		close(sink->recfd);
+	free(sink->hdrs);
+	free(sink->msgs);
+	free(sink->iovs);
+	free(sink->groups);
+	pthread_mutex_destroy(&sink->mtx);
+	for (c = 0; c < 256; c++) {
+		if (sink->pend[c] != NULL)
+			free(sink->pend[c]->buf);
+		free(sink->pend[c]);
+	}
+	free(sink->out);
+	free(sink->host);
+	free(sink->port);
+	free(sink);
+}
@@ -0,0 +1,32 @@
+struct sink_t;
+
+/* Transports */
+#define SINK_TCP	0
+#define SINK_UDP	1
+#define SINK_SHM	2	// Shared memory ring on this machine, host is its name
+#define SINK_SACN	3	// E1.31, no host sends to the multicast groups
+#define SINK_ARTNET	4
+#define SINK_REC	5	// Recorded to a .opcrec file, host is its path
+
+/* Highest universe for each, sACN starts at 1 and Art-Net at 0 */
+#define SINK_SACN_MAXUNIV	63999
+#define SINK_ARTNET_MAXUNIV	32767
+
+/* Most pixel bytes in one OPC message and messages in a frame (one per channel) */
+#define SINK_OPC_MAX	65535
+#define SINK_MAXMSGS	256
+
+/* Datagram size limits, the maximum is the most UDP can carry */
+#define SINK_UDP_MIN	64
+#define SINK_UDP_MAX	65507
+
+struct sink_t	*sink_open(int, const char *, const char *, int, int);
+struct sink_t	*sink_null(void);
+int		sink_setframe(struct sink_t *, size_t);
+int		sink_send(struct sink_t *, int, const void *, size_t, size_t);
+int		sink_nmsgs(int, int, size_t, size_t);
+int		sink_connected(struct sink_t *);
+uint64_t	sink_poll(struct sink_t *);
+int		sink_pending(struct sink_t *);
+void		sink_stats(struct sink_t *, uint64_t *, uint64_t *);
+void		sink_close(struct sink_t *);
@@ -4,18 +4,22 @@
 #include <ctype.h>
 #include <err.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <sys/time.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 #include <ccan/ciniparser/ciniparser.h>
 
 #include "config.h"
 #include "font.h"
+#include "hist.h"
+#include "kernel.h"
+#include "rt.h"
+#include "sink.h"
 #include "torch.h"
 
 typedef struct {
@@ -24,47 +28,229 @@ typedef struct {
 	uint8_t	blue;
 } __attribute((packed)) RGBPixel;
 
-typedef struct {
-	uint8_t		header[4];
-	RGBPixel	pixels[0];
-} __attribute((packed)) pixData_t;
-
-static struct config_t start_conf;
-static pixData_t *pixData = NULL;
-static int pixDataSz;
-static uint16_t	numleds;
-static int	sock;
-
-static uint8_t *currentEnergy = NULL; // current energy level
-static uint8_t *nextEnergy = NULL; // next energy level
-static uint8_t *energyMode = NULL; // mode how energy is calculated for this point
+/* Don't bother splitting a torch into bands smaller than this */
+#define BAND_MIN_LEDS	2048
+/* Levels are done this many LEDs at a time by the fused pass, small enough
+ * that the energy and pixels are still in L1 when the colours are done */
+#define FUSED_BLOCK_LEDS	2048
+/* Frames being rendered, waiting to be sent and being sent */
+#define NPIXBUFS	3
+
+/* Histograms kept for each torch, the first NSTAGES are the render stages */
+#define HIST_SENDLEDS	(NSTAGES + 0)	// sending to the outputs, in the sender thread
+#define HIST_LOCK	(NSTAGES + 1)	// waiting for the torch before rendering
+#define HIST_FRAME	(NSTAGES + 2)	// the whole frame, not counting HIST_LOCK
+#define NHISTS		(NSTAGES + 3)
+
+/* Quality governor
+ * Level 1 only simulates the flame every other frame, the text still moves
+ * every frame. Each level after that halves the frame rate as well. */
+#define GOV_LEVELS	4
+#define GOV_WEIGHT	16	// Frames the render time is averaged over (roughly)
+#define GOV_HOLD	64	// Frames to wait after changing level
+#define GOV_BACKOFF_MAX	(GOV_HOLD << 6)	// Longest to wait before trying a level which failed again
+#define GOV_HIGH	90	// Percent of the frame budget to step down at
+#define GOV_LOW		70	// and the most the level above may need to step back up
+#define GOV_SETTLE	(GOV_HOLD * 4)	// Frames a new level has to last before it is logged
+
+/* Flame or text steps a frame can take beyond its share of sim_rate when
+ * catching up, any more are dropped */
+#define SIM_CATCHUP	4
+
+struct bandarg_t {
+	struct torch_t	*torch;
+	int		band;
+};
+
+/* Everything needed to run one torch */
+struct torch_t {
+	char		name[32];
+	struct config_t	conf;
+	struct config_t	start_conf;
+	/* Every frame is sent to each of these, chan overrides torch_chan if >= 0 */
+	struct {
+		struct sink_t	*sink;
+		int		chan;
+		uint64_t	ups;	// times it had connected when last checked, sender only
+	}		outputs[MAX_SERVERS];
+	int		noutputs;
+
+	/* Pixels being rendered, one of pixBuf, the others are handed to the
+	 * sender thread so it never holds up rendering (or the other way) */
+	RGBPixel	*pixels;
+	RGBPixel	*pixBuf[NPIXBUFS];
+	uint32_t	numleds;
+
+	/* Sender thread, only these fields are shared with it and sendMtx
+	 * protects them. A ready frame which wasn't taken before the next
+	 * one was done is skipped. */
+	pthread_t	sendThr;
+	int		sendRunning;
+	pthread_mutex_t	sendMtx;
+	pthread_cond_t	sendCv;
+	int		sendStop;
+	int		readyBuf;	// newest complete frame
+	int		readyChan;	// torch_chan when it was rendered
+	int		readyKeepalive;
+	int		readyChanged;	// differs from the last frame taken
+	int		fresh;		// readyBuf hasn't been taken yet
+	int		sendFailed;
+	uint64_t	skipped;
+	uint64_t	suppressed;
+	uint64_t	sendNs;		// time spent sending
+	uint64_t	sends;
+	int		renderBuf;	// only used by the renderer
+	int		sendBuf;	// only used by the sender
+	uint64_t	renderNs;	// time spent rendering, protected by mtx
+	uint64_t	renders;
+	uint64_t	late;		// frames which overran, also protected by mtx
+	uint64_t	missed;		// deadlines skipped because of them
+	/* Time taken by each stage (ns), HIST_SENDLEDS is only added to by the
+	 * sender thread and the rest by the thread rendering */
+	struct hist_t	*hists;
+
+	/* Quality governor, protected by mtx */
+	int		govLevel;
+	int		govSince;	// frames since the level changed
+	int		govBackoff;	// frames to wait before stepping up
+	int		govWentUp;	// last change was a step up
+	uint64_t	govSim;		// moving average of render time (ns) simulating the flame
+	uint64_t	govReuse;	// and reusing the last one
+	unsigned	govFrame;
+	int		govLogged;	// level last logged
+	uint64_t	govChanges;	// times the level has changed
+	/* Last frame published, read only until it comes back for rendering */
+	RGBPixel	*lastPixels;
+	uint8_t		*lastBg;
+
+	/* Set while rendering if the frame will differ from the last one, found
+	 * from the energy and text as the pixels are worked out. Unchanged
+	 * frames aren't sent again until keepalive. */
+	int		changed;
+	int		lerpDiffers;	// the two energy fields being mixed aren't the same
+	int		lerpDiffered;	// and last frame
+	/* Last frame sent, only used by the sender thread */
+	int		lastValid;
+	struct timespec	lastTime;
+	/* What renderText drew last, the text layer only changes with these */
+	int		textShownLen;
+	int		textShownOffset;
+	int		textShownFade;
+	int		textShownMax;
+
+	uint8_t		*currentEnergy; // current energy level
+	uint8_t		*nextEnergy; // next energy level
+	uint8_t		*curMode; // mode how energy is calculated for this point
+	uint8_t		*nextMode; // mode for the next frame
+
+	/* Pixel (in wire order) for each energy level and text intensity */
+	RGBPixel	energyColour[256];
+	RGBPixel	textColour[256];
+	int		coloursValid;
+
+	/* Cells above the bottom row which aren't passive, in ascending order */
+	uint32_t	*sparks;
+	int		nsparks;
+	/* Every cell the spark pass visited last frame, their mode may differ
+	 * between the two buffers */
+	uint32_t	*sparksNext;
+	int		nvisited;
+	/* Next energy of each visited cell, in the same order */
+	uint8_t		*sparkE;
+	/* Cells which stopped being passive this frame, also ascending */
+	uint32_t	*sparkQueue;
+	int		nqueue;
+	/* Random numbers for spark creation on the second row */
+	uint8_t		*sparkDice;
+
+	uint64_t	rng;
+
+	/* Highest level simulated last frame, everything above has no energy */
+	int		simTop;
+
+	/* With sim_rate the flame and text are stepped by time, frames show
+	 * the last two energy fields mixed (nextEnergy is the older one) */
+	int		simRate;	// sim_rate the steps are being counted at
+	uint64_t	simEpoch;	// when counting started (ns)
+	uint64_t	simSteps;	// flame steps taken
+	uint64_t	textSteps;	// and text
+	int		lerp;		// weight of currentEnergy (0-255), -1 when not mixing
+	int		lerpTop;	// highest level with energy in nextEnergy
+	/* Pixel levels known to be showing just the background colour in
+	 * the buffer being rendered, each buffer has its own in bgBuf */
+	uint8_t		*bgLevel;
+	uint8_t		*bgBuf;
+
+	/* Large torches are simulated in horizontal bands, band 0 is done by
+	 * the thread rendering the frame and the rest by our own workers */
+	int		nbands;
+	pthread_t	*bandThr;
+	pthread_mutex_t	bandMtx;
+	pthread_cond_t	bandCv;
+	unsigned	bandGen;	// bumped each time a job is handed out
+	int		bandBusy;	// workers still running the current job
+	void		(*bandJob)(struct torch_t *, int);
+	struct kparams_t kp;
+	int		colourLo;	// pixel levels which need rendering
+	int		colourHi;
+
+	int		textPixels;
+	uint8_t		*textLayer;
+	char		text[100];
+	int		textLen;
+	int		textPixelOffset;
+	int		textCycleCount;
+	int		repeatCount;
+
+	pthread_mutex_t	mtx;
+};
 
 static const uint8_t energymap[32] = {0, 64, 96, 112, 128, 144, 152, 160, 168, 176, 184, 184, 192, 200, 200, 208, 208, 216, 216, 224, 224, 224, 232, 232, 232, 240, 240, 240, 240, 248, 248, 248};
 
-static int textPixels;
-static uint8_t *textLayer;
-static char text[100];
-static int textLen;
-static int textPixelOffset;
-static int textCycleCount;
-static int repeatCount;
-
-static pthread_mutex_t torch_mtx = PTHREAD_MUTEX_INITIALIZER;
-
-static void	setColourDimmed(const char *, uint16_t, uint8_t, uint8_t, uint8_t, uint8_t);
-static int	sendLEDs(void);
-static uint16_t	random16(uint16_t, uint16_t);
+static void	reset_conf(struct torch_t *);
+static void	setColourDimmed(const char *, RGBPixel *, uint8_t, uint8_t, uint8_t, uint8_t);
+static void	buildColours(struct torch_t *);
+static void	energyColours(struct torch_t *, int, int, int);
+static void	colourLevel(struct torch_t *, int, int, int);
+static int	sendLEDs(struct torch_t *, const RGBPixel *, int, int, int);
+static int	publishFrame(struct torch_t *);
+static void	reuseFrame(struct torch_t *);
+static void	govern(struct torch_t *, uint64_t, int);
+static uint64_t	govCost(struct torch_t *, int, uint64_t *);
+static int	startSender(struct torch_t *);
+static void	stopSender(struct torch_t *);
+static void *	thr_send(void *);
+static void	seedRandom(struct torch_t *, uint32_t);
+static uint32_t	random32(struct torch_t *);
+static uint16_t	random16(struct torch_t *, uint16_t, uint16_t);
+static void	randomFill(struct torch_t *, uint8_t *, int, uint8_t, uint8_t);
 static void	sat8sub(uint8_t *, uint8_t);
 static void	sat8add(uint8_t *, uint8_t);
-static void	resetEnergy(void);
-static void	resetText(void);
-static void	calcNextEnergy(struct config_t *);
-static void	calcNextColours(struct config_t *);
-static void	injectRandom(struct config_t *);
-static void	renderText(struct config_t *);
+static void	resetEnergy(struct torch_t *);
+static void	resetText(struct torch_t *);
+static uint8_t	sparkEnergy(struct torch_t *, int, int);
+static uint8_t	sparkPull(struct torch_t *, int, int);
+static int	startBands(struct torch_t *);
+static void	stopBands(struct torch_t *);
+static void *	thr_band(void *);
+static void	runBands(struct torch_t *, void (*)(struct torch_t *, int));
+static void	bandRange(int, int, int, int, int *, int *);
+static void	passiveBand(struct torch_t *, int);
+static void	colourBand(struct torch_t *, int);
+static void	fusedBand(struct torch_t *, int);
+static int	firstVisited(struct torch_t *, int);
+static int	hotLevel(struct torch_t *);
+static void	calcNextEnergy(struct torch_t *);
+static void	calcNextColours(struct torch_t *);
+static void	injectRandom(struct torch_t *);
+static void	renderText(struct torch_t *, int);
+static void	advanceText(struct torch_t *);
+static uint64_t	simDue(struct torch_t *, const struct timespec *, int *);
+static int	frameRate(struct torch_t *);
 static void	crossFade(struct config_t *, uint8_t, uint8_t, uint8_t *, uint8_t *);
-static void	setVal(struct config_t *conf, const char *, const char *);
-static void	dumpVals(struct config_t *conf);
+static void	setVal(struct torch_t *, const char *, const char *);
+static void	dumpVals(struct torch_t *);
+static void	dumpStats(struct torch_t *, int);
 
 #define TORCH_PASSIVE		0 // Just environment, glow from nearby radiation
 #define TORCH_NOP		1 // No processing
@@ -111,36 +297,143 @@ default_conf(struct config_t *conf)
 	conf->blue_energy = 0;
 	conf->upside_down = 0;
 	conf->update_rate = 30;
+	conf->governor = 0;
+	conf->keepalive = 1000;
+	conf->udp_size = SINK_UDP_MAX;
+	conf->chan_pixels = 0;
+	conf->band_threads = 1;
+	conf->spark_compat = 1;
+	conf->fused = 1;
+	memcpy(conf->colour_order, "RGB", sizeof(conf->colour_order));
 }
 
 /* Reset run-time configuration */
-void
-reset_conf(struct config_t *conf)
+static void
+reset_conf(struct torch_t *torch)
 {
-	memcpy(conf, &start_conf, sizeof(*conf));
+	memcpy(&torch->conf, &torch->start_conf, sizeof(torch->conf));
 }
 
-/* Update conf based on ini file */
+/* URL schemes for servers, the first is the default */
+static const struct {
+	const char	*prefix;
+	int		proto;
+	const char	*port;	// Used if none is given, NULL if it must be
+} schemes[] = {
+	{ "tcp://",	SINK_TCP,	NULL },
+	{ "udp://",	SINK_UDP,	NULL },
+	{ "shm://",	SINK_SHM,	"" },
+	{ "sacn://",	SINK_SACN,	"5568" },
+	{ "artnet://",	SINK_ARTNET,	"6454" },
+	{ "rec://",	SINK_REC,	"" },
+};
+#define NSCHEMES	(sizeof(schemes) / sizeof(schemes[0]))
+
+/* Set OPC servers from a list of [tcp://|udp://]host:port[/chan],
+ * shm://name[/chan], sacn://|artnet://host[:port][/universe] and
+ * rec://path strings separated by spaces or commas, replacing any already
+ * set */
+int
+setserver(struct config_t *conf, const char *str)
+{
+	struct server_t *srv;
+	char *list, *ent, *last, *num, *port;
+	unsigned int s;
+	int maxuniv;
+
+	if ((list = strdup(str)) == NULL)
+		return(-1);
+	conf->nservers = 0;
+	for (ent = strtok_r(list, " \t,", &last); ent != NULL; ent = strtok_r(NULL, " \t,", &last)) {
+		if (conf->nservers == MAX_SERVERS) {
+			fprintf(stderr, "Too many servers, at most %d are allowed\n", MAX_SERVERS);
+			goto err;
+		}
+		for (s = 0; s < NSCHEMES; s++) {
+			if (!strncmp(ent, schemes[s].prefix, strlen(schemes[s].prefix)))
+				break;
+		}
+		if (s < NSCHEMES)
+			ent += strlen(schemes[s].prefix);
+		else
+			s = 0;
+		srv = &conf->servers[conf->nservers];
+		srv->proto = schemes[s].proto;
+		srv->chan = -1;
+		srv->universe = -1;
+
+		/* A path is all name */
+		if (srv->proto != SINK_REC && (num = strchr(ent, '/')) != NULL) {
+			*num++ = '\0';
+			if (srv->proto == SINK_SACN || srv->proto == SINK_ARTNET) {
+				srv->universe = atoi(num);
+				maxuniv = srv->proto == SINK_SACN ? SINK_SACN_MAXUNIV : SINK_ARTNET_MAXUNIV;
+				if (srv->universe < (srv->proto == SINK_SACN ? 1 : 0) || srv->universe > maxuniv) {
+					fprintf(stderr, "Universe for %s is out of range\n", ent);
+					goto err;
+				}
+			} else {
+				srv->chan = atoi(num);
+				if (srv->chan < 0 || srv->chan > 255) {
+					fprintf(stderr, "Channel for %s must be between 0 and 255\n", ent);
+					goto err;
+				}
+			}
+		}
+
+		if (srv->proto == SINK_SHM || srv->proto == SINK_REC) {
+			/* Just a name, there is no port */
+			port = "";
+		} else if ((port = strrchr(ent, ':')) != NULL)
+			*port++ = '\0';
+		else if ((port = (char *)schemes[s].port) == NULL) {
+			fprintf(stderr, "Server must be specified as [tcp://|udp://]host:port[/chan], shm://name[/chan], sacn://|artnet://host[:port][/universe] or rec://path\n");
+			goto err;
+		}
+		/* sACN with no host is sent to each universe's multicast group */
+		if (*ent == '\0' && srv->proto != SINK_SACN) {
+			fprintf(stderr, "Server must have a name\n");
+			goto err;
+		}
+		if ((srv->host = strdup(ent)) == NULL || (srv->port = strdup(port)) == NULL)
+			goto err;
+		conf->nservers++;
+	}
+	free(list);
+
+	return(0);
+
+ err:
+	free(list);
+	return(-1);
+}
+
+/* Update conf based on ini file section */
+#define INI_KEY(name)		(snprintf(key, sizeof(key), "%s:%s", section, #name), key)
 #define INI_GET_INT(name)	do {					\
-	    if ((i = ciniparser_getint(ini, "torch:" #name, -1)) != -1) \
+	    if ((i = ciniparser_getint(ini, INI_KEY(name), -1)) != -1)	\
 		    conf->name = i;					\
 	} while(0)
 #define INI_GET_INT8(name)	do {					\
-	    if ((i = ciniparser_getint(ini, "torch:" #name, -1)) != -1 && \
+	    if ((i = ciniparser_getint(ini, INI_KEY(name), -1)) != -1 &&	\
 		i >= 0 && i <= 255)					\
 		    conf->name = i;					\
 	} while(0)
 #define INI_GET_BOOL(name)	do {					\
-	    if ((i = ciniparser_getboolean(ini, "torch:" #name, -1)) != -1) \
+	    if ((i = ciniparser_getboolean(ini, INI_KEY(name), -1)) != -1) \
 		    conf->name = i;					\
 	} while(0)
 int
-ini2conf(dictionary *ini, struct config_t *conf)
+ini2conf(dictionary *ini, const char *section, struct config_t *conf)
 {
 	int i;
-	char *s;
+	char *s, key[128];
 
 	/* Look for parameters */
+	if ((s = ciniparser_getstring(ini, INI_KEY(server), NULL)) != NULL) {
+		if (setserver(conf, s) != 0)
+			return(1);
+	}
 	INI_GET_INT(leds_per_level);
 	INI_GET_INT(torch_levels);
 	INI_GET_BOOL(wound_cwise);
@@ -175,8 +468,18 @@ ini2conf(dictionary *ini, struct config_t *conf)
 	INI_GET_INT8(blue_energy);
 	INI_GET_BOOL(upside_down);
 	INI_GET_INT(update_rate);
-
-	if ((s = ciniparser_getstring(ini, "torch:colour_order", NULL)) != NULL) {
+	INI_GET_INT(sim_rate);
+	INI_GET_BOOL(catch_up);
+	INI_GET_BOOL(governor);
+	INI_GET_INT(seed);
+	INI_GET_INT(udp_size);
+	INI_GET_INT(keepalive);
+	INI_GET_INT(chan_pixels);
+	INI_GET_INT(band_threads);
+	INI_GET_BOOL(spark_compat);
+	INI_GET_BOOL(fused);
+
+	if ((s = ciniparser_getstring(ini, INI_KEY(colour_order), NULL)) != NULL) {
 		if (strlen(s) != 3) {
 			fprintf(stderr, "colour_order must have 3 characters\n");
 			return(1);
@@ -193,163 +496,434 @@ ini2conf(dictionary *ini, struct config_t *conf)
 
 	/* Validate config */
 	if (conf->leds_per_level == -1) {
-		fprintf(stderr, "Must specify leds_per_level in configuration\n");
+		fprintf(stderr, "[%s]: Must specify leds_per_level in configuration\n", section);
 		return(1);
 	}
 	if (conf->torch_levels == -1) {
-		fprintf(stderr, "Must specify torch_levels in configuration\n");
+		fprintf(stderr, "[%s]: Must specify torch_levels in configuration\n", section);
 		return(1);
 	}
 	if (conf->wound_cwise == -1) {
-		fprintf(stderr, "Must specify wound_cwise in configuration\n");
+		fprintf(stderr, "[%s]: Must specify wound_cwise in configuration\n", section);
 		return(1);
 	}
 	if (conf->torch_chan == -1) {
-		fprintf(stderr, "Must specify torch_chan in configuration\n");
+		fprintf(stderr, "[%s]: Must specify torch_chan in configuration\n", section);
+		return(1);
+	}
+	if (conf->leds_per_level <= 0 || conf->torch_levels <= 0 ||
+	    (long long)conf->leds_per_level * conf->torch_levels > MAX_LEDS) {
+		fprintf(stderr, "[%s]: Torch must have between 1 and %d LEDs\n", section, MAX_LEDS);
+		return(1);
+	}
+	if (conf->chan_pixels < 0 || conf->chan_pixels > SINK_OPC_MAX / 3) {
+		fprintf(stderr, "[%s]: chan_pixels must be between 0 and %d\n", section, SINK_OPC_MAX / 3);
 		return(1);
 	}
 	if (conf->rnd_spark_prob < 0 || conf->rnd_spark_prob > 100){
-		fprintf(stderr, "rnd_spark_prob must be between 0 and 100\n");
+		fprintf(stderr, "[%s]: rnd_spark_prob must be between 0 and 100\n", section);
+		return(1);
+	}
+	if (conf->udp_size < SINK_UDP_MIN || conf->udp_size > SINK_UDP_MAX) {
+		fprintf(stderr, "[%s]: udp_size must be between %d and %d\n", section, SINK_UDP_MIN, SINK_UDP_MAX);
 		return(1);
 	}
 	if (conf->update_rate <= 0) {
-		fprintf(stderr, "update_rate must be greater than 0\n");
+		fprintf(stderr, "[%s]: update_rate must be greater than 0\n", section);
+		return(1);
+	}
+	if (conf->sim_rate < 0) {
+		fprintf(stderr, "[%s]: sim_rate can't be negative\n", section);
+		return(1);
+	}
+	if (conf->band_threads < 0) {
+		fprintf(stderr, "[%s]: band_threads can't be negative\n", section);
 		return(1);
 	}
 	if (conf->text_base_line + ROWS_PER_GLYPH > conf->torch_levels) {
-		fprintf(stderr, "text_base_line is too high, text will be truncated\n");
+		fprintf(stderr, "[%s]: text_base_line is too high, text will be truncated\n", section);
 		return(1);
 	}
+	if (checkservers(section, conf) != 0)
+		return(1);
 
 	return 0;
 }
+#undef INI_KEY
 
-/* Allocate memory and setup ready to run */
+/* Check every server has room for frames of this size, each OPC channel or
+ * sACN/Art-Net universe they are split over has to exist
+ * ini2conf does this, call it again if the servers are changed after */
 int
-create_torch(int s, struct config_t *conf)
+checkservers(const char *section, const struct config_t *conf)
 {
+	const struct server_t *srv;
+	size_t len, chunk;
+	int chan, first, last, i, n;
+
+	len = (size_t)conf->leds_per_level * conf->torch_levels * sizeof(RGBPixel);
+	chunk = conf->chan_pixels * sizeof(RGBPixel);
+	for (i = 0; i < conf->nservers; i++) {
+		srv = &conf->servers[i];
+		n = sink_nmsgs(srv->proto, conf->udp_size, len, chunk);
+		if (srv->proto == SINK_SACN || srv->proto == SINK_ARTNET) {
+			if ((first = srv->universe) == -1)
+				first = srv->proto == SINK_SACN ? 1 : 0;
+			last = srv->proto == SINK_SACN ? SINK_SACN_MAXUNIV : SINK_ARTNET_MAXUNIV;
+			if (first + n - 1 > last) {
+				fprintf(stderr, "[%s]: Frames need %d universes, %s from universe %d runs past %d\n",
+				    section, n, srv->host[0] != '\0' ? srv->host : "sACN multicast", first, last);
+				return(1);
+			}
+		} else {
+			chan = srv->chan >= 0 ? srv->chan : conf->torch_chan;
+			if (chan + n - 1 > 255) {
+				fprintf(stderr, "[%s]: Frames need %d OPC channels, %s from channel %d runs past 255\n",
+				    section, n, srv->host, chan);
+				return(1);
+			}
+		}
+	}
 
-	/* Stash a copy of the conf for later resetting */
-	memcpy(&start_conf, conf, sizeof(*conf));
+	return(0);
+}
+
+/* Allocate memory and setup ready to run */
+struct torch_t *
+create_torch(const char *name, struct config_t *conf)
+{
+	struct torch_t *torch;
+	int i;
 
-	sock = s;
+	if ((torch = calloc(1, sizeof(*torch))) == NULL)
+		return(NULL);
 
-	numleds = conf->leds_per_level * conf->torch_levels;
-	assert(numleds > 0);
-	pixDataSz = sizeof(*pixData) + numleds * sizeof(pixData->pixels[0]);
-	if ((pixData = malloc(pixDataSz)) == NULL)
+	strncpy(torch->name, name, sizeof(torch->name) - 1);
+	pthread_mutex_init(&torch->mtx, NULL);
+
+	/* Take our own copy of the conf, and another for later resetting */
+	memcpy(&torch->conf, conf, sizeof(*conf));
+	memcpy(&torch->start_conf, conf, sizeof(*conf));
+
+	torch->numleds = conf->leds_per_level * conf->torch_levels;
+	assert(torch->numleds > 0);
+	for (i = 0; i < NPIXBUFS; i++) {
+		if ((torch->pixBuf[i] = malloc(torch->numleds * sizeof(torch->pixBuf[i][0]))) == NULL)
+			goto err;
+	}
+	if ((torch->currentEnergy = malloc(torch->numleds * sizeof(torch->currentEnergy[0]))) == NULL)
 		goto err;
-	if ((currentEnergy = malloc(numleds * sizeof(currentEnergy[0]))) == NULL)
+	if ((torch->nextEnergy = malloc(torch->numleds * sizeof(torch->nextEnergy[0]))) == NULL)
 		goto err;
-	if ((nextEnergy = malloc(numleds * sizeof(nextEnergy[0]))) == NULL)
+	if ((torch->curMode = malloc(torch->numleds * sizeof(torch->curMode[0]))) == NULL)
 		goto err;
-	if ((energyMode = malloc(numleds * sizeof(energyMode[0]))) == NULL)
+	if ((torch->nextMode = malloc(torch->numleds * sizeof(torch->nextMode[0]))) == NULL)
 		goto err;
-	textPixels = conf->leds_per_level * ROWS_PER_GLYPH;
-	assert(textPixels > 0);
-	if ((textLayer = malloc(textPixels * sizeof(textLayer[0]))) == NULL)
+	if ((torch->sparks = malloc(torch->numleds * sizeof(torch->sparks[0]))) == NULL)
+		goto err;
+	if ((torch->sparksNext = malloc(torch->numleds * sizeof(torch->sparksNext[0]))) == NULL)
+		goto err;
+	if ((torch->sparkQueue = malloc(torch->numleds * sizeof(torch->sparkQueue[0]))) == NULL)
+		goto err;
+	if ((torch->sparkE = malloc(torch->numleds * sizeof(torch->sparkE[0]))) == NULL)
+		goto err;
+	if ((torch->sparkDice = malloc(conf->leds_per_level * sizeof(torch->sparkDice[0]))) == NULL)
+		goto err;
+	if ((torch->bgBuf = calloc(NPIXBUFS * conf->torch_levels, sizeof(torch->bgBuf[0]))) == NULL)
+		goto err;
+	if ((torch->hists = calloc(NHISTS, sizeof(torch->hists[0]))) == NULL)
+		goto err;
+	torch->renderBuf = 0;
+	torch->readyBuf = 1;
+	torch->sendBuf = 2;
+	torch->pixels = torch->pixBuf[torch->renderBuf];
+	torch->bgLevel = torch->bgBuf;
+	torch->govBackoff = GOV_HOLD;
+	torch->textPixels = conf->leds_per_level * ROWS_PER_GLYPH;
+	assert(torch->textPixels > 0);
+	if ((torch->textLayer = malloc(torch->textPixels * sizeof(torch->textLayer[0]))) == NULL)
 		goto err;
 
-	pixData->header[0] = conf->torch_chan;
-	pixData->header[1] = 0; // Command: set LEDs
-	pixData->header[2] = (numleds * sizeof(pixData->pixels[0])) >> 8; // Length MSB
-	pixData->header[3] = (numleds * sizeof(pixData->pixels[0])) & 0xff; // Length LSB
-
-	resetEnergy();
-	resetText();
+	/* In real time mode every page is there before the first frame */
+	for (i = 0; i < NPIXBUFS; i++)
+		rt_prefault(torch->pixBuf[i], torch->numleds * sizeof(torch->pixBuf[i][0]));
+	rt_prefault(torch->sparks, torch->numleds * sizeof(torch->sparks[0]));
+	rt_prefault(torch->sparksNext, torch->numleds * sizeof(torch->sparksNext[0]));
+	rt_prefault(torch->sparkQueue, torch->numleds * sizeof(torch->sparkQueue[0]));
+	rt_prefault(torch->sparkE, torch->numleds * sizeof(torch->sparkE[0]));
+	rt_prefault(torch->hists, NHISTS * sizeof(torch->hists[0]));
+
+	seedRandom(torch, conf->seed);
+	resetEnergy(torch);	// touches the energy and mode buffers
+	resetText(torch);
+	buildColours(torch);
+
+	if (startBands(torch) != 0)
+		goto err;
+	if (startSender(torch) != 0)
+		goto err;
 
-	return(0);
+	return(torch);
 
  err:
-	free_torch();
-	return(-1);
+	free_torch(torch);
+	return(NULL);
 }
 
+/* Send every frame to sink as well, chan overrides torch_chan if >= 0
+ * We own the sink reference from here on, even if this fails */
 int
-run_torch(struct config_t *conf)
+add_sink(struct torch_t *torch, struct sink_t *sink, int chan)
 {
-	int sl, t, frame;
-	struct timeval then, now;
 
-	frame = 0;
-	while (1) {
-		assert(pthread_mutex_lock(&torch_mtx) == 0);
+	if (torch->noutputs == MAX_SERVERS) {
+		warnx("%s: too many outputs", torch->name);
+		sink_close(sink);
+		return(-1);
+	}
+	if (sink_setframe(sink, torch->numleds * sizeof(RGBPixel)) != 0) {
+		sink_close(sink);
+		return(-1);
+	}
+	torch->outputs[torch->noutputs].sink = sink;
+	torch->outputs[torch->noutputs].chan = chan;
+	torch->noutputs++;
 
-		frame++;
-		gettimeofday(&then, NULL);
-		renderText(conf);
-		injectRandom(conf);
-		calcNextEnergy(conf);
-		calcNextColours(conf);
+	return(0);
+}
 
-		if (sendLEDs() != 0)
-			return(-1);
+/* Render and send a single frame */
+int
+run_torch(struct torch_t *torch)
+{
 
-		gettimeofday(&now, NULL);
-		timersub(&now, &then, &now);
-		t = now.tv_sec * 1000000 + now.tv_usec;
-		sl = (1000000 / conf->update_rate) - t;
-#if 0
-		if (frame % 10 == 0)
-			printf("%5d: Loop took %5d usec, sleeping %5d usec\n", frame, t, sl);
-#endif
-		assert(pthread_mutex_unlock(&torch_mtx) == 0);
+	return(run_torch_timed(torch, NULL));
+}
 
-		usleep(sl);
+/* As run_torch but add the time taken by each stage (in ns) to times if it isn't NULL */
+int
+run_torch_timed(struct torch_t *torch, uint64_t *times)
+{
+	struct timespec ts[NSTAGES + 1], asked;
+	uint64_t ns, due, steps, most;
+	int frac, rtn, s, sim;
+
+	clock_gettime(CLOCK_MONOTONIC, &asked);
+	assert(pthread_mutex_lock(&torch->mtx) == 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts[0]);
+	hist_add(&torch->hists[HIST_LOCK], (ts[0].tv_sec - asked.tv_sec) * 1000000000LL +
+	    ts[0].tv_nsec - asked.tv_nsec);
+	/* The governor may have us skip the flame every other frame */
+	sim = torch->govLevel == 0 || torch->lastPixels == NULL || (torch->govFrame++ & 1) == 0;
+
+	/* With sim_rate as many steps are taken as have come due (maybe none),
+	 * otherwise one a frame */
+	if (torch->conf.sim_rate > 0) {
+		due = simDue(torch, &ts[0], &frac);
+		most = torch->conf.sim_rate / frameRate(torch) + SIM_CATCHUP;
+		if (due - torch->textSteps > most)
+			torch->textSteps = due - most;
+		for (; torch->textSteps < due; torch->textSteps++)
+			advanceText(torch);
+		renderText(torch, frac);
+		if (due - torch->simSteps > most)
+			torch->simSteps = due - most;
+		steps = sim ? due - torch->simSteps : 0;
+		torch->lerp = frac;
+	} else {
+		renderText(torch, 0);
+		advanceText(torch);
+		steps = sim;
+		torch->simRate = 0;
+		torch->lerp = -1;
+	}
+	torch->simSteps += steps;
+	clock_gettime(CLOCK_MONOTONIC, &ts[STAGE_TEXT + 1]);
+	if (steps > 0)
+		injectRandom(torch);
+	clock_gettime(CLOCK_MONOTONIC, &ts[STAGE_INJECT + 1]);
+	/* Injecting for any further steps is counted as energy */
+	for (; steps > 0; steps--) {
+		torch->lerpTop = torch->simTop;
+		calcNextEnergy(torch);
+		if (steps > 1)
+			injectRandom(torch);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts[STAGE_ENERGY + 1]);
+	if (sim) {
+		calcNextColours(torch);
+		// a mix of two fields changes with the time, as does the frame after one
+		if (torch->lerpDiffers || torch->lerpDiffered)
+			torch->changed = 1;
+		torch->lerpDiffered = torch->lerpDiffers;
+		torch->lerpDiffers = 0;
+	} else
+		reuseFrame(torch);
+	clock_gettime(CLOCK_MONOTONIC, &ts[STAGE_COLOURS + 1]);
+
+	/* Sending is done by the sender thread, this just hands the frame over */
+	rtn = publishFrame(torch);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts[STAGE_SEND + 1]);
+	for (s = 0; s < NSTAGES; s++) {
+		ns = (ts[s + 1].tv_sec - ts[s].tv_sec) * 1000000000LL +
+		    ts[s + 1].tv_nsec - ts[s].tv_nsec;
+		hist_add(&torch->hists[s], ns);
+		if (times != NULL)
+			times[s] += ns;
 	}
+	ns = (ts[NSTAGES].tv_sec - ts[0].tv_sec) * 1000000000LL +
+	    ts[NSTAGES].tv_nsec - ts[0].tv_nsec;
+	hist_add(&torch->hists[HIST_FRAME], ns);
+	torch->renderNs += ns;
+	torch->renders++;
+	govern(torch, ns, sim);
 
-	return(0);
+	assert(pthread_mutex_unlock(&torch->mtx) == 0);
+
+	return(rtn);
 }
 
 void
-free_torch(void)
+free_torch(struct torch_t *torch)
 {
-	if (pixData != NULL) {
-		free(pixData);
-		pixData = NULL;
-	}
-	if (currentEnergy != NULL) {
-		free(currentEnergy);
-		currentEnergy = NULL;
-	}
-	if (nextEnergy != NULL) {
-		free(nextEnergy);
-		nextEnergy = NULL;
-	}
-	if (energyMode != NULL) {
-		free(energyMode);
-		energyMode = NULL;
-	}
-	if (textLayer != NULL) {
-		free(textLayer);
-		textLayer = NULL;
+	int i;
+
+	if (torch == NULL)
+		return;
+
+	stopSender(torch);
+	stopBands(torch);
+	for (i = 0; i < NPIXBUFS; i++)
+		free(torch->pixBuf[i]);
+	free(torch->currentEnergy);
+	free(torch->nextEnergy);
+	free(torch->curMode);
+	free(torch->nextMode);
+	free(torch->sparks);
+	free(torch->sparksNext);
+	free(torch->sparkQueue);
+	free(torch->sparkE);
+	free(torch->sparkDice);
+	free(torch->bgBuf);
+	free(torch->textLayer);
+	free(torch->hists);
+	for (i = 0; i < torch->noutputs; i++)
+		sink_close(torch->outputs[i].sink);
+	pthread_mutex_destroy(&torch->mtx);
+	free(torch);
+}
+
+const char *
+torch_name(struct torch_t *torch)
+{
+
+	return(torch->name);
+}
+
+/* Fold the last frame rendered into h (FNV-1a), start with TORCH_HASH_INIT
+ * A seeded run hashed frame by frame can be compared with a known good one */
+uint64_t
+torch_hash(struct torch_t *torch, uint64_t h)
+{
+	const uint8_t *p;
+	size_t i;
+
+	assert(pthread_mutex_lock(&torch->mtx) == 0);
+	if (torch->lastPixels != NULL) {
+		p = (const uint8_t *)torch->lastPixels;
+		for (i = 0; i < torch->numleds * sizeof(torch->lastPixels[0]); i++)
+			h = (h ^ p[i]) * 0x100000001b3ULL;
 	}
+	assert(pthread_mutex_unlock(&torch->mtx) == 0);
+
+	return(h);
+}
+
+/* Frame rate to render at, lowered by the governor when we can't keep up */
+int
+torch_rate(struct torch_t *torch)
+{
+	int rate;
+
+	assert(pthread_mutex_lock(&torch->mtx) == 0);
+	rate = frameRate(torch);
+	assert(pthread_mutex_unlock(&torch->mtx) == 0);
+
+	return(rate);
+}
+
+int
+torch_catchup(struct torch_t *torch)
+{
+	int catchup;
+
+	assert(pthread_mutex_lock(&torch->mtx) == 0);
+	catchup = torch->conf.catch_up;
+	assert(pthread_mutex_unlock(&torch->mtx) == 0);
+
+	return(catchup);
+}
+
+/* As torch_rate but called with the torch locked */
+static int
+frameRate(struct torch_t *torch)
+{
+	int rate;
+
+	rate = torch->conf.update_rate;
+	if (torch->govLevel > 1)
+		rate >>= torch->govLevel - 1;
+
+	return(rate > 0 ? rate : 1);
+}
+
+/* Called by the scheduler when a frame finished after the next one was due
+ * and it skipped missed deadlines to get back on time */
+void
+torch_overrun(struct torch_t *torch, uint64_t missed)
+{
+
+	assert(pthread_mutex_lock(&torch->mtx) == 0);
+	torch->late++;
+	torch->missed += missed;
+	assert(pthread_mutex_unlock(&torch->mtx) == 0);
+}
+
+const char *
+stage_name(int stage)
+{
+	static const char *names[NSTAGES] = {
+		"text", "inject", "energy", "colours", "send"
+	};
+
+	if (stage < 0 || stage >= NSTAGES)
+		return("unknown");
+	return(names[stage]);
 }
 
 #define COLOUR_SET(idx, colname) do {				\
 	tmp = (colname * bright) >> 8;				\
 	switch (order[idx]) {					\
         case 'R':						\
-		pixData->pixels[lednum].red = tmp;		\
+		pixel->red = tmp;				\
 		break;						\
 								\
 	case 'G':						\
-		pixData->pixels[lednum].green = tmp;		\
+		pixel->green = tmp;				\
 		break;						\
 								\
 	case 'B':						\
-		pixData->pixels[lednum].blue = tmp;		\
+		pixel->blue = tmp;				\
 		break;						\
 	}							\
 } while(0)
 static void
-setColourDimmed(const char *order, uint16_t lednum, uint8_t red, uint8_t green, uint8_t blue, uint8_t bright)
+setColourDimmed(const char *order, RGBPixel *pixel, uint8_t red, uint8_t green, uint8_t blue, uint8_t bright)
 {
 	uint8_t tmp;
 
-	if (lednum >= numleds)
-		return;
-
 	COLOUR_SET(0, red);
 	COLOUR_SET(1, green);
 	COLOUR_SET(2, blue);
@@ -373,8 +947,9 @@ splitargs(char *cmd, char **argv, int nargv, int *argc)
 	}
 }
 
+/* Run a command from a client, replies are written to fd */
 void
-cmd_torch(struct config_t *conf, const char *from, char *cmd)
+cmd_torch(struct torch_t *torch, const char *from, int fd, char *cmd)
 {
 	char *argv[10], *origline, *tmp;
 	int argc;
@@ -382,47 +957,333 @@ cmd_torch(struct config_t *conf, const char *from, char *cmd)
 	origline = strdup(cmd);
 	splitargs(cmd, argv, sizeof(argv) / sizeof(argv[0]), &argc);
 
-	assert(pthread_mutex_lock(&torch_mtx) == 0);
+	assert(pthread_mutex_lock(&torch->mtx) == 0);
 
-	fprintf(stderr, "Command from %s: %s\n", from, argv[0]);
+	fprintf(stderr, "Command for %s from %s: %s\n", torch->name, from, argv[0]);
 	if (!strcmp(argv[0], "message")) {
 		if (argc == 1) {
-			newMessage(conf, "");
+			newMessage(torch, "");
 		} else {
 			tmp = strchr(origline, ' ');
 			tmp++;
-			newMessage(conf, tmp);
+			newMessage(torch, tmp);
 		}
 	} else if (!strcmp(argv[0], "set")) {
-		if (argc == 3)
-			setVal(conf, argv[1], argv[2]);
-		else
+		if (argc == 3) {
+			setVal(torch, argv[1], argv[2]);
+			torch->coloursValid = 0;
+		} else
 			warnx("Bad usage for set command");
 	} else if (!strcmp(argv[0], "reset")) {
-		reset_conf(conf);
+		reset_conf(torch);
+		torch->coloursValid = 0;
 	} else if (!strcmp(argv[0], "dump")) {
-		dumpVals(conf);
+		dumpVals(torch);
+	} else if (!strcmp(argv[0], "stats")) {
+		dumpStats(torch, fd);
 	}
 
 	free(origline);
-	assert(pthread_mutex_unlock(&torch_mtx) == 0);
+	assert(pthread_mutex_unlock(&torch->mtx) == 0);
+}
+
+/* Send pixels to every output, called by the sender thread
+ * Returns 1 if they haven't changed since last time and a keepalive isn't
+ * due, outputs which have reconnected since are always sent to */
+static int
+sendLEDs(struct torch_t *torch, const RGBPixel *pixels, int torch_chan, int keepalive, int changed)
+{
+	struct timespec now;
+	uint64_t ups;
+	int64_t ms;
+	int chan, i, reconnected, rtn;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (keepalive > 0 && torch->lastValid && !changed) {
+		reconnected = 0;
+		for (i = 0; i < torch->noutputs; i++) {
+			if ((ups = sink_poll(torch->outputs[i].sink)) != torch->outputs[i].ups) {
+				torch->outputs[i].ups = ups;
+				reconnected = 1;
+			}
+		}
+		ms = (now.tv_sec - torch->lastTime.tv_sec) * 1000 +
+		    (now.tv_nsec - torch->lastTime.tv_nsec) / 1000000;
+		if (!reconnected && ms < keepalive)
+			return(1);
+	}
+
+	/* Rendered once, every output gets the same pixels */
+	rtn = 0;
+	for (i = 0; i < torch->noutputs; i++) {
+		chan = torch->outputs[i].chan >= 0 ? torch->outputs[i].chan : torch_chan;
+		if (sink_send(torch->outputs[i].sink, chan, pixels,
+		    torch->numleds * sizeof(pixels[0]), torch->conf.chan_pixels * sizeof(pixels[0])) != 0)
+			rtn = -1;
+	}
+	torch->lastValid = 1;
+	torch->lastTime = now;
+
+	return(rtn);
+}
+
+/* Hand the frame just rendered to the sender and start on another buffer
+ * Fails if sending went wrong since the last frame */
+static int
+publishFrame(struct torch_t *torch)
+{
+	int b, rtn;
+
+	assert(pthread_mutex_lock(&torch->sendMtx) == 0);
+	b = torch->readyBuf;
+	torch->readyBuf = torch->renderBuf;
+	torch->renderBuf = b;
+	torch->readyChan = torch->conf.torch_chan;
+	torch->readyKeepalive = torch->conf.keepalive;
+	/* A frame which is skipped may have been the one which changed */
+	torch->readyChanged = torch->changed || (torch->fresh && torch->readyChanged);
+	if (torch->fresh)
+		torch->skipped++;
+	torch->fresh = 1;
+	rtn = torch->sendFailed ? -1 : 0;
+	pthread_cond_signal(&torch->sendCv);
+	assert(pthread_mutex_unlock(&torch->sendMtx) == 0);
+	torch->changed = 0;
+
+	torch->lastPixels = torch->pixels;
+	torch->lastBg = torch->bgLevel;
+	torch->pixels = torch->pixBuf[b];
+	torch->bgLevel = torch->bgBuf + b * torch->conf.torch_levels;
+
+	return(rtn);
+}
+
+/* Show the last frame again with the text moved on, for when the governor
+ * skips simulating the flame. The energy is what the last frame showed.
+ * Only the text rows are redrawn so only they can change the frame. */
+static void
+reuseFrame(struct torch_t *torch)
+{
+	struct config_t *conf = &torch->conf;
+	RGBPixel px;
+	int i, p, ei, start, end, textStart;
+
+	if (!torch->coloursValid)
+		buildColours(torch);
+	memcpy(torch->pixels, torch->lastPixels, torch->numleds * sizeof(torch->pixels[0]));
+	memcpy(torch->bgLevel, torch->lastBg, conf->torch_levels * sizeof(torch->bgLevel[0]));
+
+	textStart = conf->text_base_line * conf->leds_per_level;
+	/* Rows of text off the bottom of the torch aren't drawn */
+	p = conf->text_base_line > 0 ? conf->text_base_line : 0;
+	for (; p < conf->text_base_line + ROWS_PER_GLYPH && p < conf->torch_levels; p++) {
+		start = p * conf->leds_per_level;
+		end = start + conf->leds_per_level;
+		for (i = start; i < end; i++) {
+			ei = conf->upside_down ? torch->numleds - 1 - i : i;
+			if (torch->textLayer[i - textStart] > 0)
+				px = torch->textColour[torch->textLayer[i - textStart]];
+			else
+				px = torch->energyColour[torch->currentEnergy[ei]];
+			if (memcmp(&torch->pixels[i], &px, sizeof(px))) {
+				torch->pixels[i] = px;
+				torch->changed = 1;
+			}
+		}
+		torch->bgLevel[p] = 0;
+	}
+}
+
+/* Step the quality down when the average frame takes most of the time
+ * there is for it and back up when the level above would have room to
+ * spare, called with the torch locked after each frame
+ * Timings at one level don't always hold at another (e.g. the sender
+ * thread wants the same CPU) so each time stepping up doesn't last we wait
+ * twice as long before trying again. */
+static void
+govern(struct torch_t *torch, uint64_t ns, int sim)
+{
+	uint64_t *avg, cost, budget, upcost, upbudget;
+	int level;
+
+	if (!torch->conf.governor) {
+		torch->govLevel = 0;
+		torch->govLogged = 0;
+		return;
+	}
+	avg = sim ? &torch->govSim : &torch->govReuse;
+	*avg = *avg + ((int64_t)ns - (int64_t)*avg) / GOV_WEIGHT;
+	/* The level can go back and forth while it finds one which holds, only
+	 * say once it has stayed put (stats counts every change) */
+	if (++torch->govSince == GOV_SETTLE && torch->govLevel != torch->govLogged) {
+		cost = govCost(torch, torch->govLevel, &budget);
+		warnx("%s: frames take %lluus of %lluus, quality level %d", torch->name,
+		    (unsigned long long)cost / 1000, (unsigned long long)budget / 1000, torch->govLevel);
+		torch->govLogged = torch->govLevel;
+	}
+	if (torch->govSince < GOV_HOLD)
+		return;
+	/* Stepping up worked */
+	if (torch->govWentUp && torch->govSince == 2 * torch->govBackoff)
+		torch->govBackoff = GOV_HOLD;
+
+	level = torch->govLevel;
+	cost = govCost(torch, level, &budget);
+	if (cost * 100 > budget * GOV_HIGH && level < GOV_LEVELS - 1) {
+		level++;
+		if (torch->govWentUp && torch->govBackoff < GOV_BACKOFF_MAX)
+			torch->govBackoff *= 2;
+	} else if (level > 0 && torch->govSince >= torch->govBackoff) {
+		upcost = govCost(torch, level - 1, &upbudget);
+		if (upcost * 100 < upbudget * GOV_LOW)
+			level--;
+	}
+	if (level == torch->govLevel)
+		return;
+
+	torch->govChanges++;
+	torch->govWentUp = level < torch->govLevel;
+	torch->govLevel = level;
+	torch->govSince = 0;
+}
+
+/* Average time a frame takes at a quality level and the time there is for it (ns) */
+static uint64_t
+govCost(struct torch_t *torch, int level, uint64_t *budget)
+{
+	int rate;
+
+	rate = torch->conf.update_rate;
+	if (level > 1)
+		rate >>= level - 1;
+	*budget = 1000000000ULL / (rate > 0 ? rate : 1);
+
+	if (level == 0)
+		return(torch->govSim);
+	return((torch->govSim + torch->govReuse) / 2);
 }
 
 static int
-sendLEDs(void)
+startSender(struct torch_t *torch)
 {
-	int rtn;
 
-	if ((rtn = send(sock, pixData, pixDataSz, 0)) < 0) {
-		warn("Unable to send data");
+	pthread_mutex_init(&torch->sendMtx, NULL);
+	pthread_cond_init(&torch->sendCv, NULL);
+	if (pthread_create(&torch->sendThr, NULL, &thr_send, torch) != 0) {
+		warnx("%s: Unable to start sender thread", torch->name);
+		pthread_cond_destroy(&torch->sendCv);
+		pthread_mutex_destroy(&torch->sendMtx);
 		return(-1);
 	}
+	torch->sendRunning = 1;
 
 	return(0);
 }
 
+static void
+stopSender(struct torch_t *torch)
+{
+
+	if (!torch->sendRunning)
+		return;
+
+	assert(pthread_mutex_lock(&torch->sendMtx) == 0);
+	torch->sendStop = 1;
+	pthread_cond_signal(&torch->sendCv);
+	assert(pthread_mutex_unlock(&torch->sendMtx) == 0);
+	pthread_join(torch->sendThr, NULL);
+
+	pthread_cond_destroy(&torch->sendCv);
+	pthread_mutex_destroy(&torch->sendMtx);
+	torch->sendRunning = 0;
+}
+
+/* Send the newest frame whenever there is one */
+static void *
+thr_send(void *arg)
+{
+	struct torch_t *torch = arg;
+	struct timespec start, end;
+	sigset_t sigs;
+	uint64_t ns;
+	int b, chan, changed, keepalive, rtn;
+
+	/* Signals are handled by the main thread */
+	sigfillset(&sigs);
+	if (pthread_sigmask(SIG_BLOCK, &sigs, NULL) != 0)
+		warn("Unable to block signals");
+	rt_thread(RT_SENDER);
+
+	assert(pthread_mutex_lock(&torch->sendMtx) == 0);
+	while (!torch->sendStop) {
+		if (!torch->fresh) {
+			pthread_cond_wait(&torch->sendCv, &torch->sendMtx);
+			continue;
+		}
+		b = torch->readyBuf;
+		torch->readyBuf = torch->sendBuf;
+		torch->sendBuf = b;
+		torch->fresh = 0;
+		chan = torch->readyChan;
+		keepalive = torch->readyKeepalive;
+		changed = torch->readyChanged;
+		assert(pthread_mutex_unlock(&torch->sendMtx) == 0);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		rtn = sendLEDs(torch, torch->pixBuf[b], chan, keepalive, changed);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		ns = (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec;
+		if (rtn == 0)
+			hist_add(&torch->hists[HIST_SENDLEDS], ns);
+
+		assert(pthread_mutex_lock(&torch->sendMtx) == 0);
+		/* The torch is done for, the next publishFrame fails and the
+		 * scheduler stops running it */
+		if (rtn < 0) {
+			warnx("%s: Unable to send frame, stopping sender", torch->name);
+			torch->sendFailed = 1;
+			break;
+		} else if (rtn > 0)
+			torch->suppressed++;
+		else {
+			torch->sendNs += ns;
+			torch->sends++;
+		}
+	}
+	assert(pthread_mutex_unlock(&torch->sendMtx) == 0);
+
+	return(NULL);
+}
+
+/* Per torch PCG32 generator so runs with the same seed are repeatable */
+static void
+seedRandom(struct torch_t *torch, uint32_t seed)
+{
+
+	if (seed == 0)
+		seed = time(NULL) ^ getpid() ^ (uintptr_t)torch;
+	torch->rng = 0;
+	random32(torch);
+	torch->rng += seed;
+	random32(torch);
+}
+
+static uint32_t
+random32(struct torch_t *torch)
+{
+	uint64_t old;
+	uint32_t xorshifted, rot;
+
+	old = torch->rng;
+	torch->rng = old * 6364136223846793005ULL + 1442695040888963407ULL;
+	xorshifted = ((old >> 18) ^ old) >> 27;
+	rot = old >> 59;
+	return((xorshifted >> rot) | (xorshifted << ((-rot) & 31)));
+}
+
 static uint16_t
-random16(uint16_t aMinOrMax, uint16_t aMax)
+random16(struct torch_t *torch, uint16_t aMinOrMax, uint16_t aMax)
 {
 	uint32_t r;
 
@@ -432,10 +1293,33 @@ random16(uint16_t aMinOrMax, uint16_t aMax)
 	}
 	r = aMinOrMax;
 	aMax = aMax - aMinOrMax + 1;
-	r += rand() % aMax;
+	// scale rather than take the remainder, no division needed
+	r += ((uint64_t)random32(torch) * aMax) >> 32;
 	return(r);
 }
 
+/* Fill buf with n random values in [min, max], two values per random number */
+static void
+randomFill(struct torch_t *torch, uint8_t *buf, int n, uint8_t min, uint8_t max)
+{
+	uint32_t r, range;
+	int i;
+
+	if (max < min) {
+		r = min;
+		min = max;
+		max = r;
+	}
+	range = max - min + 1;
+	for (i = 0; i + 1 < n; i += 2) {
+		r = random32(torch);
+		buf[i] = min + (((r & 0xffff) * range) >> 16);
+		buf[i + 1] = min + (((r >> 16) * range) >> 16);
+	}
+	if (i < n)
+		buf[i] = min + (((random32(torch) & 0xffff) * range) >> 16);
+}
+
 static void
 sat8sub(uint8_t *aByte, uint8_t aAmount)
 {
@@ -461,153 +1345,641 @@ sat8add(uint8_t *aByte, uint8_t aAmount)
 }
 
 static void
-resetEnergy(void)
+resetEnergy(struct torch_t *torch)
 {
 	int i;
 
-	for (i = 0; i < numleds; i++) {
-		currentEnergy[i] = 0;
-		nextEnergy[i] = 0;
-		energyMode[i] = TORCH_PASSIVE;
+	for (i = 0; i < torch->numleds; i++) {
+		torch->currentEnergy[i] = 0;
+		torch->nextEnergy[i] = 0;
+		// bottom row is refilled by injectRandom every frame
+		if (i < torch->conf.leds_per_level)
+			torch->curMode[i] = TORCH_NOP;
+		else
+			torch->curMode[i] = TORCH_PASSIVE;
+		torch->nextMode[i] = torch->curMode[i];
 	}
+	torch->nsparks = 0;
+	torch->nvisited = 0;
+	torch->nqueue = 0;
+	torch->simTop = torch->conf.torch_levels - 1;
 }
 
 
 static void
-resetText(void)
+resetText(struct torch_t *torch)
 {
 	int i;
 
-	for(i = 0; i < textPixels; i++) {
-		textLayer[i] = 0;
+	for(i = 0; i < torch->textPixels; i++) {
+		torch->textLayer[i] = 0;
+	}
+}
+
+/* Next energy of a spark or temp spark, the original algorithm
+ * Sparks hand over to the level above by changing its mode (and the mode
+ * of the cell below once it is exhausted) so cells must be done in order.
+ * Works in place on nextMode which starts off as a copy of curMode. */
+static uint8_t
+sparkEnergy(struct torch_t *torch, int i, int y)
+{
+	struct config_t *conf = &torch->conf;
+	uint8_t *energyMode = torch->nextMode;
+	uint8_t e, e2;
+
+	e = torch->currentEnergy[i];
+	switch (energyMode[i]) {
+	case TORCH_SPARK:
+		// lose transfer up energy as long as there is any
+		sat8sub(&e, conf->spark_tfr);
+		// cell above is temp spark, sucking up energy from this cell until empty
+		if (y < conf->torch_levels - 1) {
+			if (energyMode[i + conf->leds_per_level] == TORCH_PASSIVE)
+				torch->sparkQueue[torch->nqueue++] = i + conf->leds_per_level;
+			energyMode[i + conf->leds_per_level] = TORCH_SPARK_TEMP;
+		}
+		break;
+
+	case TORCH_SPARK_TEMP:
+		// just getting some energy from below
+		e2 = torch->currentEnergy[i - conf->leds_per_level];
+		if (e2 < conf->spark_tfr) {
+			// cell below is exhausted, becomes passive
+			energyMode[i - conf->leds_per_level] = TORCH_PASSIVE;
+			// gobble up rest of energy
+			sat8add(&e, e2);
+			// loose some overall energy
+			e = ((int)e * conf->spark_cap) >>8;
+			// this cell becomes active spark
+			energyMode[i] = TORCH_SPARK;
+		} else {
+			sat8add(&e, conf->spark_tfr);
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	return(e);
+}
+
+/* Next energy and mode of a spark, temp spark or the cell above a spark
+ * Only reads the current buffers so cells can be done in any order. The
+ * result only differs from sparkEnergy when three sparks are stacked up,
+ * which rarely happens, the original turns the middle one into a temp
+ * spark before it gets to the top one. */
+static uint8_t
+sparkPull(struct torch_t *torch, int i, int y)
+{
+	struct config_t *conf = &torch->conf;
+	uint8_t *curMode = torch->curMode;
+	int lpl = conf->leds_per_level;
+	uint8_t e, e2, mode, consumed;
+
+	// a spark below makes this a temp spark whatever it was
+	if (curMode[i - lpl] == TORCH_SPARK)
+		mode = TORCH_SPARK_TEMP;
+	else
+		mode = curMode[i];
+
+	// the temp spark above takes the last of our energy
+	consumed = y < conf->torch_levels - 1 &&
+	    (curMode[i] == TORCH_SPARK || curMode[i + lpl] == TORCH_SPARK_TEMP) &&
+	    torch->currentEnergy[i] < conf->spark_tfr;
+
+	e = torch->currentEnergy[i];
+	switch (mode) {
+	case TORCH_SPARK:
+		sat8sub(&e, conf->spark_tfr);
+		if (y < conf->torch_levels - 1 && curMode[i + lpl] == TORCH_PASSIVE)
+			torch->sparkQueue[torch->nqueue++] = i + lpl;
+		break;
+
+	case TORCH_SPARK_TEMP:
+		e2 = torch->currentEnergy[i - lpl];
+		if (e2 < conf->spark_tfr) {
+			sat8add(&e, e2);
+			e = ((int)e * conf->spark_cap) >>8;
+			mode = TORCH_SPARK;
+		} else
+			sat8add(&e, conf->spark_tfr);
+		break;
+
+	default:
+		break;
+	}
+	torch->nextMode[i] = consumed ? TORCH_PASSIVE : mode;
+
+	return(e);
+}
+
+/* Start band workers if the torch is big enough and we are allowed threads
+ * Bands only read the level below them from the shared current energy so
+ * nothing has to be copied between them, just a handover at each stage. */
+static int
+startBands(struct torch_t *torch)
+{
+	struct bandarg_t *arg;
+	int b, want;
+
+	want = torch->conf.band_threads;
+	if (want > (int)(torch->numleds / BAND_MIN_LEDS))
+		want = torch->numleds / BAND_MIN_LEDS;
+	if (want > torch->conf.torch_levels - 1)
+		want = torch->conf.torch_levels - 1;
+	torch->nbands = 1;
+	if (want <= 1)
+		return(0);
+
+	if ((torch->bandThr = calloc(want, sizeof(torch->bandThr[0]))) == NULL)
+		return(-1);
+	pthread_mutex_init(&torch->bandMtx, NULL);
+	pthread_cond_init(&torch->bandCv, NULL);
+	for (b = 1; b < want; b++) {
+		if ((arg = malloc(sizeof(*arg))) == NULL)
+			break;
+		arg->torch = torch;
+		arg->band = b;
+		if (pthread_create(&torch->bandThr[b], NULL, &thr_band, arg) != 0) {
+			free(arg);
+			break;
+		}
+		torch->nbands++;
 	}
+	if (torch->nbands < want)
+		warnx("%s: Only started %d of %d band threads", torch->name, torch->nbands, want);
+
+	return(0);
 }
 
 static void
-calcNextEnergy(struct config_t *conf)
-{
-	int x, y, i;
-	uint8_t e, m, e2, tmp;
-
-	i = 0;
-	for (y = 0; y < conf->torch_levels; y++) {
-		for (x = 0; x < conf->leds_per_level; x++) {
-			e = currentEnergy[i];
-			m = energyMode[i];
-			switch (m) {
-			case TORCH_SPARK:
-				// lose transfer up energy as long as there is any
-				sat8sub(&e, conf->spark_tfr);
-				// cell above is temp spark, sucking up energy from this cell until empty
-				if (y < conf->torch_levels - 1) {
-					energyMode[i + conf->leds_per_level] = TORCH_SPARK_TEMP;
-				}
-				break;
+stopBands(struct torch_t *torch)
+{
+	int b;
 
-			case TORCH_SPARK_TEMP:
-				// just getting some energy from below
-				e2 = currentEnergy[i - conf->leds_per_level];
-				if (e2 < conf->spark_tfr) {
-					// cell below is exhausted, becomes passive
-					energyMode[i - conf->leds_per_level] = TORCH_PASSIVE;
-					// gobble up rest of energy
-					sat8add(&e, e2);
-					// loose some overall energy
-					e = ((int)e * conf->spark_cap) >>8;
-					// this cell becomes active spark
-					energyMode[i] = TORCH_SPARK;
-				} else {
-					sat8add(&e, conf->spark_tfr);
-				}
-				break;
-			case TORCH_PASSIVE:
-				e = ((int)e * conf->heat_cap) >> 8;
-				if (i < numleds - 1)
-					tmp = currentEnergy[i + 1];
-				else
-					tmp = 0;
-				sat8add(&e, ((((int)currentEnergy[i - 1] + (int)tmp) * conf->side_rad) >> 9) +
-				    (((int)currentEnergy[i - conf->leds_per_level] * conf->up_rad) >> 8));
-
-			default:
-				break;
-			}
-			nextEnergy[i++] = e;
+	if (torch->bandThr == NULL)
+		return;
+
+	/* A NULL job tells the workers to exit */
+	assert(pthread_mutex_lock(&torch->bandMtx) == 0);
+	torch->bandJob = NULL;
+	torch->bandGen++;
+	pthread_cond_broadcast(&torch->bandCv);
+	assert(pthread_mutex_unlock(&torch->bandMtx) == 0);
+	for (b = 1; b < torch->nbands; b++)
+		pthread_join(torch->bandThr[b], NULL);
+
+	pthread_cond_destroy(&torch->bandCv);
+	pthread_mutex_destroy(&torch->bandMtx);
+	free(torch->bandThr);
+	torch->bandThr = NULL;
+	torch->nbands = 1;
+}
+
+static void *
+thr_band(void *arg)
+{
+	struct bandarg_t *ba = arg;
+	struct torch_t *torch = ba->torch;
+	void (*job)(struct torch_t *, int);
+	int band = ba->band;
+	unsigned gen;
+	sigset_t sigs;
+
+	free(ba);
+
+	/* Signals are handled by the main thread */
+	sigfillset(&sigs);
+	if (pthread_sigmask(SIG_BLOCK, &sigs, NULL) != 0)
+		warn("Unable to block signals");
+	rt_thread(RT_RENDER);
+
+	/* Start from the generation we were created in, a job may already
+	 * have been handed out before we got here */
+	gen = 0;
+	assert(pthread_mutex_lock(&torch->bandMtx) == 0);
+	while (1) {
+		while (torch->bandGen == gen)
+			pthread_cond_wait(&torch->bandCv, &torch->bandMtx);
+		gen = torch->bandGen;
+		if ((job = torch->bandJob) == NULL)
+			break;
+		assert(pthread_mutex_unlock(&torch->bandMtx) == 0);
+
+		job(torch, band);
+
+		assert(pthread_mutex_lock(&torch->bandMtx) == 0);
+		if (--torch->bandBusy == 0)
+			pthread_cond_broadcast(&torch->bandCv);
+	}
+	assert(pthread_mutex_unlock(&torch->bandMtx) == 0);
+
+	return(NULL);
+}
+
+/* Run job for every band and wait for them all to finish */
+static void
+runBands(struct torch_t *torch, void (*job)(struct torch_t *, int))
+{
+
+	if (torch->nbands == 1) {
+		job(torch, 0);
+		return;
+	}
+
+	assert(pthread_mutex_lock(&torch->bandMtx) == 0);
+	torch->bandJob = job;
+	torch->bandBusy = torch->nbands - 1;
+	torch->bandGen++;
+	pthread_cond_broadcast(&torch->bandCv);
+	assert(pthread_mutex_unlock(&torch->bandMtx) == 0);
+
+	job(torch, 0);
+
+	assert(pthread_mutex_lock(&torch->bandMtx) == 0);
+	while (torch->bandBusy > 0)
+		pthread_cond_wait(&torch->bandCv, &torch->bandMtx);
+	assert(pthread_mutex_unlock(&torch->bandMtx) == 0);
+}
+
+/* Share levels [lo, hi) out between n bands */
+static void
+bandRange(int lo, int hi, int band, int n, int *start, int *end)
+{
+
+	*start = lo + ((hi - lo) * band) / n;
+	*end = lo + ((hi - lo) * (band + 1)) / n;
+}
+
+static void
+passiveBand(struct torch_t *torch, int band)
+{
+	int lpl, start, end;
+
+	lpl = torch->conf.leds_per_level;
+	bandRange(1, torch->simTop + 1, band, torch->nbands, &start, &end);
+	passive_cells(torch->nextEnergy, torch->currentEnergy, start * lpl, end * lpl, &torch->kp);
+}
+
+/* Highest level with any energy
+ * Sparks without energy don't count, the spark pass still moves them up
+ * but everything they touch above this level stays at zero. */
+static int
+hotLevel(struct torch_t *torch)
+{
+	struct config_t *conf = &torch->conf;
+	int i, y;
+	uint8_t any;
+
+	for (y = conf->torch_levels - 1; y > 0; y--) {
+		any = 0;
+		for (i = y * conf->leds_per_level; i < (y + 1) * conf->leds_per_level; i++)
+			any |= torch->currentEnergy[i];
+		if (any != 0)
+			return(y);
+	}
+
+	return(0);
+}
+
+static void
+calcNextEnergy(struct torch_t *torch)
+{
+	struct config_t *conf = &torch->conf;
+	uint8_t *tmp;
+	int i, s, q, n, simTop;
+
+	torch->kp.numleds = torch->numleds;
+	torch->kp.leds_per_level = conf->leds_per_level;
+	torch->kp.heat_cap = conf->heat_cap;
+	torch->kp.side_rad = conf->side_rad;
+	torch->kp.up_rad = conf->up_rad;
+
+	// bottom row is refilled by injectRandom and never changes by itself
+	memcpy(torch->nextEnergy, torch->currentEnergy, conf->leds_per_level);
+
+	// energy can only spread one level per frame so nothing above this changes
+	simTop = hotLevel(torch) + 1;
+	if (simTop > conf->torch_levels - 1)
+		simTop = conf->torch_levels - 1;
+	if (simTop < torch->simTop)
+		memset(torch->nextEnergy + (simTop + 1) * conf->leds_per_level, 0,
+		    (torch->simTop - simTop) * conf->leds_per_level);
+	torch->simTop = simTop;
+
+	// only cells visited last frame can differ between the mode buffers
+	for (s = 0; s < torch->nvisited; s++)
+		torch->nextMode[torch->sparksNext[s]] = torch->curMode[torch->sparksNext[s]];
+
+	// walk the sparks in cell order, merging in cells as they become temp sparks
+	s = q = n = 0;
+	while (s < torch->nsparks || q < torch->nqueue) {
+		if (q == torch->nqueue || (s < torch->nsparks && torch->sparks[s] < torch->sparkQueue[q]))
+			i = torch->sparks[s++];
+		else
+			i = torch->sparkQueue[q++];
+		if (conf->spark_compat)
+			torch->sparkE[n] = sparkEnergy(torch, i, i / conf->leds_per_level);
+		else
+			torch->sparkE[n] = sparkPull(torch, i, i / conf->leds_per_level);
+		torch->sparksNext[n++] = i;
+	}
+	torch->nqueue = 0;
+	torch->nvisited = n;
+
+	// drop sparks which were exhausted by the temp spark above them
+	torch->nsparks = 0;
+	for (s = 0; s < n; s++) {
+		if (torch->nextMode[torch->sparksNext[s]] != TORCH_PASSIVE)
+			torch->sparks[torch->nsparks++] = torch->sparksNext[s];
+	}
+
+	tmp = torch->curMode;
+	torch->curMode = torch->nextMode;
+	torch->nextMode = tmp;
+
+	if (conf->fused && torch->lerp < 0) {
+		// energy and colours a block of levels at a time, then swap buffers
+		if (!torch->coloursValid)
+			buildColours(torch);
+		runBands(torch, fusedBand);
+		tmp = torch->currentEnergy;
+		torch->currentEnergy = torch->nextEnergy;
+		torch->nextEnergy = tmp;
+	} else {
+		// treat everything else as passive, then redo the few cells which aren't
+		runBands(torch, passiveBand);
+		for (s = 0; s < n; s++)
+			torch->nextEnergy[torch->sparksNext[s]] = torch->sparkE[s];
+		// when mixing frames the colours need both, the old one is kept in nextEnergy
+		if (torch->lerp >= 0) {
+			tmp = torch->currentEnergy;
+			torch->currentEnergy = torch->nextEnergy;
+			torch->nextEnergy = tmp;
 		}
 	}
 }
 
+/* Index of the first visited cell at or after cell i */
+static int
+firstVisited(struct torch_t *torch, int i)
+{
+	int lo, hi, mid;
+
+	lo = 0;
+	hi = torch->nvisited;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (torch->sparksNext[mid] < i)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return(lo);
+}
+
+/* Next energy and pixels for one band of levels
+ * The simulated levels are shared out evenly, the last band also does the
+ * cold ones above them. The spark pass has already run so every level can
+ * be finished (and coloured) before moving on to the next. */
+static void
+fusedBand(struct torch_t *torch, int band)
+{
+	struct config_t *conf = &torch->conf;
+	int lpl, lo, hi, blk, y, y0, y1, p0, p1, s;
+
+	lpl = conf->leds_per_level;
+	bandRange(0, torch->simTop + 1, band, torch->nbands, &lo, &hi);
+	if (band == torch->nbands - 1)
+		hi = conf->torch_levels;
+	blk = FUSED_BLOCK_LEDS / lpl;
+	if (blk < 1)
+		blk = 1;
+
+	s = firstVisited(torch, lo * lpl);
+	for (y0 = lo; y0 < hi; y0 = y1) {
+		y1 = y0 + blk < hi ? y0 + blk : hi;
+
+		// passive cells in this block which can have energy
+		p0 = y0 > 1 ? y0 : 1;
+		p1 = y1 < torch->simTop + 1 ? y1 : torch->simTop + 1;
+		if (p0 < p1)
+			passive_cells(torch->nextEnergy, torch->currentEnergy, p0 * lpl, p1 * lpl, &torch->kp);
+		for (; s < torch->nvisited && torch->sparksNext[s] < y1 * lpl; s++)
+			torch->nextEnergy[torch->sparksNext[s]] = torch->sparkE[s];
+
+		for (y = y0; y < y1; y++)
+			colourLevel(torch, conf->upside_down ? conf->torch_levels - 1 - y : y, y, 0);
+	}
+}
+
+/* Work out the pixel for every energy and text intensity */
 static void
-calcNextColours(struct config_t *conf)
+buildColours(struct torch_t *torch)
 {
-	int i, ei, textStart, textEnd;
-	uint16_t e;
+	struct config_t *conf = &torch->conf;
 	uint8_t eb, r, g, b;
+	int e;
+
+	for (e = 0; e < 256; e++) {
+		if (e > 250)
+			setColourDimmed(conf->colour_order, &torch->energyColour[e], e, e, e, conf->brightness); // white extra-bright spark
+		else if (e > 0) {
+			// energy to brightness is non-linear
+			eb = energymap[e >> 3];
+			r = conf->red_bias;
+			g = conf->green_bias;
+			b = conf->blue_bias;
+			sat8add(&r, (eb * conf->red_energy) >> 8);
+			sat8add(&g, (eb * conf->green_energy) >> 8);
+			sat8add(&b, (eb * conf->blue_energy) >> 8);
+			setColourDimmed(conf->colour_order, &torch->energyColour[e], r, g, b, conf->brightness);
+		} else {
+			// background, no energy
+			setColourDimmed(conf->colour_order, &torch->energyColour[e], conf->red_bg, conf->green_bg, conf->blue_bg, conf->brightness);
+		}
+
+		setColourDimmed(conf->colour_order, &torch->textColour[e], conf->text_red, conf->text_green, conf->text_blue,
+		    (conf->brightness * e) >> 8);
+	}
+	torch->coloursValid = 1;
+	torch->changed = 1;
+
+	// background may have changed, in every buffer
+	memset(torch->bgBuf, 0, NPIXBUFS * torch->conf.torch_levels * sizeof(torch->bgBuf[0]));
+}
+
+/* Set pixels [start, end) from the next flame energy
+ * The two pass version also copies it to the current energy as it goes.
+ * The current energy is what the last frame showed so comparing them as
+ * we go says whether the pixels changed, without looking at the pixels. */
+static void
+energyColours(struct torch_t *torch, int start, int end, int copy)
+{
+	RGBPixel *pixels = torch->pixels;
+	uint8_t *nextEnergy = torch->nextEnergy;
+	uint8_t *currentEnergy = torch->currentEnergy;
+	int i, ei, f;
+	uint8_t diff;
+
+	diff = 0;
+	if (torch->lerp >= 0) {
+		// mix the last two steps, nextEnergy is the older
+		f = torch->lerp;
+		for (i = start; i < end; i++) {
+			ei = torch->conf.upside_down ? torch->numleds - 1 - i : i;
+			diff |= nextEnergy[ei] ^ currentEnergy[ei];
+			pixels[i] = torch->energyColour[(nextEnergy[ei] * (256 - f) + currentEnergy[ei] * f) >> 8];
+		}
+		// the mix depends on the time whenever the two differ
+		if (diff != 0)
+			__atomic_store_n(&torch->lerpDiffers, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (torch->conf.upside_down) {
+		for (i = start; i < end; i++) {
+			ei = torch->numleds - 1 - i;
+			diff |= nextEnergy[ei] ^ currentEnergy[ei];
+			if (copy)
+				currentEnergy[ei] = nextEnergy[ei];
+			pixels[i] = torch->energyColour[nextEnergy[ei]];
+		}
+	} else {
+		for (i = start; i < end; i++) {
+			diff |= nextEnergy[i] ^ currentEnergy[i];
+			if (copy)
+				currentEnergy[i] = nextEnergy[i];
+			pixels[i] = torch->energyColour[nextEnergy[i]];
+		}
+	}
+	// bands run this at the same time, they can only ever set it
+	if (diff != 0)
+		__atomic_store_n(&torch->changed, 1, __ATOMIC_RELAXED);
+}
+
+/* Render pixel level p which shows energy level y */
+static void
+colourLevel(struct torch_t *torch, int p, int y, int copy)
+{
+	struct config_t *conf = &torch->conf;
+	int i, ei, start, end, textStart;
 
+	start = p * conf->leds_per_level;
+	end = start + conf->leds_per_level;
 	textStart = conf->text_base_line * conf->leds_per_level;
-	textEnd = textStart + ROWS_PER_GLYPH * conf->leds_per_level;
 
-	for (i = 0; i < numleds; i++) {
-		if (i >= textStart && i < textEnd && textLayer[i - textStart] > 0) {
-			// overlay with text color
-			setColourDimmed(conf->colour_order, i, conf->text_red, conf->text_green, conf->text_blue,
-			    (conf->brightness * textLayer[i - textStart]) >> 8);
-		} else {
-			if (conf->upside_down)
-				ei = numleds - i;
-			else
-				ei = i;
-			e = nextEnergy[ei];
-			currentEnergy[ei] = e;
-			if (e > 250)
-				setColourDimmed(conf->colour_order, i, e, e, e, conf->brightness); // white extra-bright spark
-			else {
-				if (e > 0) {
-					// energy to brightness is non-linear
-					eb = energymap[e >> 3];
-					r = conf->red_bias;
-					g = conf->green_bias;
-					b = conf->blue_bias;
-					sat8add(&r, (eb * conf->red_energy) >> 8);
-					sat8add(&g, (eb * conf->green_energy) >> 8);
-					sat8add(&b, (eb * conf->blue_energy) >> 8);
-					setColourDimmed(conf->colour_order, i, r, g, b, conf->brightness);
-				} else {
-					// background, no energy
-					setColourDimmed(conf->colour_order, i, conf->red_bg, conf->green_bg, conf->blue_bg, conf->brightness);
+	if (p >= conf->text_base_line && p < conf->text_base_line + ROWS_PER_GLYPH) {
+		for (i = start; i < end; i++) {
+			if (torch->textLayer[i - textStart] > 0) {
+				// overlay with text color
+				torch->pixels[i] = torch->textColour[torch->textLayer[i - textStart]];
+				// energy under the text isn't updated, the fused pass
+				// swaps buffers so it has to be carried over
+				if (!copy) {
+					ei = conf->upside_down ? torch->numleds - 1 - i : i;
+					torch->nextEnergy[ei] = torch->currentEnergy[ei];
 				}
-			}
+			} else
+				energyColours(torch, i, i + 1, copy);
 		}
+		torch->bgLevel[p] = 0;
+	} else if (y <= torch->simTop || (torch->lerp >= 0 && y <= torch->lerpTop)) {
+		energyColours(torch, start, end, copy);
+		torch->bgLevel[p] = 0;
+	} else if (!torch->bgLevel[p]) {
+		// no energy, only needs setting once
+		for (i = start; i < end; i++)
+			torch->pixels[i] = torch->energyColour[0];
+		torch->bgLevel[p] = 1;
 	}
 }
 
+/* Render pixel levels for one band, the levels which need work are shared
+ * out evenly and the first and last bands also check the rest */
+static void
+colourBand(struct torch_t *torch, int band)
+{
+	struct config_t *conf = &torch->conf;
+	int p, lo, hi;
+
+	bandRange(torch->colourLo, torch->colourHi, band, torch->nbands, &lo, &hi);
+	if (band == 0)
+		lo = 0;
+	if (band == torch->nbands - 1)
+		hi = conf->torch_levels;
+
+	for (p = lo; p < hi; p++)
+		colourLevel(torch, p, conf->upside_down ? conf->torch_levels - 1 - p : p, 1);
+}
+
+/* Two pass version of the colours, the fused pass has already done them */
 static void
-injectRandom(struct config_t *conf)
+calcNextColours(struct torch_t *torch)
 {
+	struct config_t *conf = &torch->conf;
+	int top;
+
+	if (conf->fused && torch->lerp < 0)
+		return;
+	if (!torch->coloursValid)
+		buildColours(torch);
+
+	// pixel levels showing simulated energy, plus the text
+	top = torch->simTop;
+	if (torch->lerp >= 0 && torch->lerpTop > top)
+		top = torch->lerpTop;
+	if (conf->upside_down) {
+		torch->colourLo = conf->torch_levels - 1 - top;
+		torch->colourHi = conf->torch_levels;
+	} else {
+		torch->colourLo = 0;
+		torch->colourHi = top + 1;
+	}
+	if (torch->colourLo > conf->text_base_line)
+		torch->colourLo = conf->text_base_line;
+	if (torch->colourLo < 0)
+		torch->colourLo = 0;
+	if (torch->colourHi < conf->text_base_line + ROWS_PER_GLYPH)
+		torch->colourHi = conf->text_base_line + ROWS_PER_GLYPH;
+	if (torch->colourHi > conf->torch_levels)
+		torch->colourHi = conf->torch_levels;
+
+	runBands(torch, colourBand);
+}
+
+static void
+injectRandom(struct torch_t *torch)
+{
+	struct config_t *conf = &torch->conf;
 	int i;
 
 	// random flame energy at bottom row
-	for (i = 0; i < conf->leds_per_level; i++) {
-		currentEnergy[i] = random16(conf->flame_min, conf->flame_max);
-		energyMode[i] = TORCH_NOP;
-	}
-	// random sparks at second row
+	randomFill(torch, torch->currentEnergy, conf->leds_per_level, conf->flame_min, conf->flame_max);
+	// random sparks at second row, these sort before anything calcNextEnergy queues
+	randomFill(torch, torch->sparkDice, conf->leds_per_level, 0, 100);
 	for (i = conf->leds_per_level; i < 2 *conf->leds_per_level; i++) {
-		if (energyMode[i] != TORCH_SPARK && random16(100, 0) < conf->rnd_spark_prob) {
-			currentEnergy[i] = random16(conf->spark_min, conf->spark_max);
-			energyMode[i] = TORCH_SPARK;
+		if (torch->curMode[i] != TORCH_SPARK && torch->sparkDice[i - conf->leds_per_level] < conf->rnd_spark_prob) {
+			torch->currentEnergy[i] = random16(torch, conf->spark_min, conf->spark_max);
+			if (torch->curMode[i] == TORCH_PASSIVE)
+				torch->sparkQueue[torch->nqueue++] = i;
+			// both buffers so the spark pass sees it whichever way it runs
+			torch->curMode[i] = TORCH_SPARK;
+			torch->nextMode[i] = TORCH_SPARK;
 		}
 	}
 }
 
 void
-newMessage(struct config_t *conf, char *msg)
+newMessage(struct torch_t *torch, char *msg)
 {
-	strncpy(text, msg, sizeof(text) - 1);
-	textLen = strlen(text);
-	textPixelOffset = -conf->leds_per_level;
-	textCycleCount = 0;
-	repeatCount = 0;
+	strncpy(torch->text, msg, sizeof(torch->text) - 1);
+	torch->textLen = strlen(torch->text);
+	torch->textPixelOffset = -torch->conf.leds_per_level;
+	torch->textCycleCount = 0;
+	torch->repeatCount = 0;
+	torch->changed = 1;
 }
 
 static
@@ -622,34 +1994,50 @@ void crossFade(struct config_t *conf, uint8_t aFader, uint8_t aValue, uint8_t *a
 	*aOutputA = baseBrightness + (varBrightness - fade);
 }
 
+/* Draw the text into textLayer, frac is how far (0-255) we are through
+ * the current step */
 static void
-renderText(struct config_t *conf)
+renderText(struct torch_t *torch, int frac)
 {
-	uint8_t maxBright, thisBright, nextBright, column;
-	int pixelsPerChar, activeCols, totalTextPixels, x, rowPixelOffset, charIndex, glyphOffset, glyphRow;
+	struct config_t *conf = &torch->conf;
+	uint8_t *textLayer = torch->textLayer;
+	uint8_t maxBright, thisBright, nextBright, column, fade;
+	int pixelsPerChar, activeCols, x, rowPixelOffset, charIndex, glyphOffset, glyphRow;
 	int i, leftstep;
 	char c;
 
 	// fade between rows
 	maxBright = conf->text_intensity - conf->text_repeats * conf->fade_per_repeat;
-
-	crossFade(conf, 255 * textCycleCount / conf->text_cycles_per_px, maxBright, &thisBright, &nextBright);
+	fade = 255 * (torch->textCycleCount * 256 + frac) / (conf->text_cycles_per_px * 256);
+
+	crossFade(conf, fade, maxBright, &thisBright, &nextBright);
+
+	// the layer is drawn from just these (and the message and conf, which
+	// mark the frame changed themselves)
+	if (torch->textLen != torch->textShownLen || (torch->textLen > 0 &&
+	    (torch->textPixelOffset != torch->textShownOffset || fade != torch->textShownFade ||
+	    maxBright != torch->textShownMax))) {
+		torch->textShownLen = torch->textLen;
+		torch->textShownOffset = torch->textPixelOffset;
+		torch->textShownFade = fade;
+		torch->textShownMax = maxBright;
+		torch->changed = 1;
+	}
 
 	// generate vertical rows
 	pixelsPerChar = BYTES_PER_GLYPH + GLYPH_SPACING;
 	activeCols = conf->leds_per_level - 2;
-	totalTextPixels = textLen * pixelsPerChar;
 	for (x = 0; x < conf->leds_per_level; x++) {
 		column = 0;
 		// determine font row
 		if (x < activeCols) {
-			rowPixelOffset = textPixelOffset + x;
+			rowPixelOffset = torch->textPixelOffset + x;
 			if (rowPixelOffset >= 0) {
 				// visible row
 				charIndex = rowPixelOffset / pixelsPerChar;
-				if (textLen > charIndex) {
+				if (torch->textLen > charIndex) {
 					// visible char
-					c = text[charIndex];
+					c = torch->text[charIndex];
 					glyphOffset = rowPixelOffset % pixelsPerChar;
 					if (glyphOffset < BYTES_PER_GLYPH) {
 						// fetch glyph column
@@ -685,35 +2073,45 @@ renderText(struct config_t *conf)
 			textLayer[i] = 0; // no text
 		}
 	}
-	// increment
-	textCycleCount++;
-	if (textCycleCount >= conf->text_cycles_per_px) {
-		textCycleCount = 0;
-		textPixelOffset++;
-		if (textPixelOffset > totalTextPixels) {
+}
+
+/* Move the text on a step */
+static void
+advanceText(struct torch_t *torch)
+{
+	struct config_t *conf = &torch->conf;
+	int totalTextPixels;
+
+	totalTextPixels = torch->textLen * (BYTES_PER_GLYPH + GLYPH_SPACING);
+	torch->textCycleCount++;
+	if (torch->textCycleCount >= conf->text_cycles_per_px) {
+		torch->textCycleCount = 0;
+		torch->textPixelOffset++;
+		if (torch->textPixelOffset > totalTextPixels) {
 			// text shown, check for repeats
-			repeatCount++;
-			if (conf->text_repeats != 0 && repeatCount >= conf->text_repeats) {
+			torch->repeatCount++;
+			if (conf->text_repeats != 0 && torch->repeatCount >= conf->text_repeats) {
 				// done
-				strcpy(text, ""); // remove text
-				textLen = 0;
+				strcpy(torch->text, ""); // remove text
+				torch->textLen = 0;
 			}
 			else {
 				// show again
-				textPixelOffset = -conf->leds_per_level;
-				textCycleCount = 0;
+				torch->textPixelOffset = -conf->leds_per_level;
+				torch->textCycleCount = 0;
 			}
 		}
 	}
 }
 
 static void
-setVal(struct config_t *conf, const char *key, const char *val)
+setVal(struct torch_t *torch, const char *key, const char *val)
 {
+	struct config_t *conf = &torch->conf;
 	int tmp;
 
 	tmp = atoi(val);
-	
+
 	if (!strcmp(key, "brightness"))
 		conf->brightness = tmp;
 	else if (!strcmp(key, "fade_base"))
@@ -726,8 +2124,12 @@ setVal(struct config_t *conf, const char *key, const char *val)
 		conf->text_repeats = tmp;
 	else if (!strcmp(key, "fade_per_repeat"))
 		conf->fade_per_repeat = tmp;
-	else if (!strcmp(key, "text_base_line"))
-		conf->text_base_line = tmp;
+	else if (!strcmp(key, "text_base_line")) {
+		if (tmp >= 0 && tmp + ROWS_PER_GLYPH <= conf->torch_levels)
+			conf->text_base_line = tmp;
+		else
+			warnx("text_base_line must be between 0 and %d", conf->torch_levels - ROWS_PER_GLYPH);
+	}
 	else if (!strcmp(key, "text_red"))
 		conf->text_red = tmp;
 	else if (!strcmp(key, "text_green"))
@@ -774,18 +2176,43 @@ setVal(struct config_t *conf, const char *key, const char *val)
 		conf->blue_energy = tmp;
 	else if (!strcmp(key, "upside_down"))
 		conf->upside_down = tmp;
-	else if (!strcmp(key, "update_rate"))
-		conf->update_rate = tmp;
-	else
+	else if (!strcmp(key, "update_rate")) {
+		if (tmp > 0)
+			conf->update_rate = tmp;
+		else
+			warnx("update_rate must be greater than 0");
+	} else if (!strcmp(key, "sim_rate")) {
+		if (tmp >= 0)
+			conf->sim_rate = tmp;
+		else
+			warnx("sim_rate can't be negative");
+	} else if (!strcmp(key, "catch_up"))
+		conf->catch_up = tmp;
+	else if (!strcmp(key, "governor"))
+		conf->governor = tmp;
+	else if (!strcmp(key, "spark_compat"))
+		conf->spark_compat = tmp;
+	else if (!strcmp(key, "fused"))
+		conf->fused = tmp;
+	else if (!strcmp(key, "keepalive"))
+		conf->keepalive = tmp;
+	else if (!strcmp(key, "seed")) {
+		// restart the sequence so runs can be compared
+		conf->seed = tmp;
+		seedRandom(torch, tmp);
+	} else
 		warnx("Unknown key %s", key);
 }
 
 static void
-dumpVals(struct config_t *conf)
+dumpVals(struct torch_t *torch)
 {
+	struct config_t *conf = &torch->conf;
+	uint64_t dropped, coalesced, d, c;
+	int i;
 
 	fprintf(stderr, "=============\n");
-	fprintf(stderr, "Configuration\n");
+	fprintf(stderr, "Configuration for %s\n", torch->name);
 	fprintf(stderr, "=============\n");
 	fprintf(stderr, "%-20s: %d\n", "brightness", conf->brightness);
 	fprintf(stderr, "%-20s: %d\n", "fade_base", conf->fade_base);
@@ -818,5 +2245,94 @@ dumpVals(struct config_t *conf)
 	fprintf(stderr, "%-20s: %d\n", "blue_energy", conf->blue_energy);
 	fprintf(stderr, "%-20s: %d\n", "upside_down", conf->upside_down);
 	fprintf(stderr, "%-20s: %d\n", "update_rate", conf->update_rate);
+	fprintf(stderr, "%-20s: %d\n", "sim_rate", conf->sim_rate);
+	fprintf(stderr, "%-20s: %d\n", "catch_up", conf->catch_up);
+	fprintf(stderr, "%-20s: %d\n", "governor", conf->governor);
+	fprintf(stderr, "%-20s: %d\n", "quality_level", torch->govLevel);
+	fprintf(stderr, "%-20s: %llu\n", "quality_changes", (unsigned long long)torch->govChanges);
+	fprintf(stderr, "%-20s: %d\n", "seed", conf->seed);
+	fprintf(stderr, "%-20s: %d\n", "spark_compat", conf->spark_compat);
+	fprintf(stderr, "%-20s: %d\n", "fused", conf->fused);
+	fprintf(stderr, "%-20s: %s\n", "kernel", kernel_name());
+	dropped = coalesced = 0;
+	for (i = 0; i < torch->noutputs; i++) {
+		sink_stats(torch->outputs[i].sink, &d, &c);
+		dropped += d;
+		coalesced += c;
+	}
+	fprintf(stderr, "%-20s: %llu\n", "frames_dropped", (unsigned long long)dropped);
+	fprintf(stderr, "%-20s: %llu\n", "frames_coalesced", (unsigned long long)coalesced);
+	fprintf(stderr, "%-20s: %d\n", "keepalive", conf->keepalive);
+	fprintf(stderr, "%-20s: %d\n", "chan_pixels", conf->chan_pixels);
+	assert(pthread_mutex_lock(&torch->sendMtx) == 0);
+	fprintf(stderr, "%-20s: %llu\n", "frames_suppressed", (unsigned long long)torch->suppressed);
+	fprintf(stderr, "%-20s: %llu\n", "frames_skipped", (unsigned long long)torch->skipped);
+	fprintf(stderr, "%-20s: %llu\n", "send_ns", (unsigned long long)(torch->sends ? torch->sendNs / torch->sends : 0));
+	assert(pthread_mutex_unlock(&torch->sendMtx) == 0);
+	fprintf(stderr, "%-20s: %llu\n", "render_ns", (unsigned long long)(torch->renders ? torch->renderNs / torch->renders : 0));
+	fprintf(stderr, "%-20s: %llu\n", "frames_late", (unsigned long long)torch->late);
+	fprintf(stderr, "%-20s: %llu\n", "frames_missed", (unsigned long long)torch->missed);
+	fprintf(stderr, "%-20s: %d\n", "bands", torch->nbands);
 	fprintf(stderr, "\n");
 }
+
+/* Send the time taken by each stage and how many frames were late to fd,
+ * called with the torch locked */
+static void
+dumpStats(struct torch_t *torch, int fd)
+{
+	static const char *names[NHISTS] = {
+		"text", "inject", "energy", "colours", "handoff", "send", "lock", "frame"
+	};
+	struct histsum_t sum;
+	uint64_t dropped, coalesced, skipped, d, c;
+	int h, i;
+
+	dprintf(fd, "%s\n", torch->name);
+	dprintf(fd, "%-10s %10s %10s %10s %10s %10s\n", "ns", "count", "min", "p50", "p99", "max");
+	for (h = 0; h < NHISTS; h++) {
+		hist_read(&torch->hists[h], &sum);
+		dprintf(fd, "%-10s %10llu %10llu %10llu %10llu %10llu\n", names[h],
+		    (unsigned long long)sum.count, (unsigned long long)sum.min,
+		    (unsigned long long)sum.p50, (unsigned long long)sum.p99,
+		    (unsigned long long)sum.max);
+	}
+
+	dropped = coalesced = 0;
+	for (i = 0; i < torch->noutputs; i++) {
+		sink_stats(torch->outputs[i].sink, &d, &c);
+		dropped += d;
+		coalesced += c;
+	}
+	assert(pthread_mutex_lock(&torch->sendMtx) == 0);
+	skipped = torch->skipped;
+	assert(pthread_mutex_unlock(&torch->sendMtx) == 0);
+	dprintf(fd, "level %d changes %llu late %llu missed %llu skipped %llu dropped %llu coalesced %llu\n",
+	    torch->govLevel, (unsigned long long)torch->govChanges, (unsigned long long)torch->late, (unsigned long long)torch->missed,
+	    (unsigned long long)skipped, (unsigned long long)dropped,
+	    (unsigned long long)coalesced);
+}
+
+/* Number of steps which should have been started at sim_rate by now and
+ * how far through the last one we are (0-255) */
+static uint64_t
+simDue(struct torch_t *torch, const struct timespec *now, int *frac)
+{
+	uint64_t ns, part;
+	int rate;
+
+	rate = torch->conf.sim_rate;
+	ns = now->tv_sec * 1000000000ULL + now->tv_nsec;
+	if (rate != torch->simRate) {
+		// start counting again from here
+		torch->simRate = rate;
+		torch->simEpoch = ns;
+		torch->simSteps = 0;
+		torch->textSteps = 0;
+	}
+
+	ns -= torch->simEpoch;
+	part = ns % 1000000000ULL * rate;
+	*frac = part % 1000000000ULL * 256 / 1000000000ULL;
+	return(ns / 1000000000ULL * rate + part / 1000000000ULL + 1);
+}
@@ -1,8 +1,31 @@
-void	default_conf(struct config_t *);
-void	reset_conf(struct config_t *);
-int	ini2conf(dictionary *, struct config_t *);
-int	create_torch(int, struct config_t *);
-int	run_torch(struct config_t *);
-void	free_torch(void);
-void	cmd_torch(struct config_t *, const char *, char *);
-void	newMessage(struct config_t *, char *);
+struct torch_t;
+struct sink_t;
+
+/* Stages of rendering a frame, for run_torch_timed */
+#define STAGE_TEXT	0
+#define STAGE_INJECT	1
+#define STAGE_ENERGY	2
+#define STAGE_COLOURS	3
+#define STAGE_SEND	4
+#define NSTAGES		5
+
+/* Starting value for torch_hash */
+#define TORCH_HASH_INIT	0xcbf29ce484222325ULL
+
+void		default_conf(struct config_t *);
+int		setserver(struct config_t *, const char *);
+int		ini2conf(dictionary *, const char *, struct config_t *);
+int		checkservers(const char *, const struct config_t *);
+struct torch_t	*create_torch(const char *, struct config_t *);
+int		add_sink(struct torch_t *, struct sink_t *, int);
+int		run_torch(struct torch_t *);
+int		run_torch_timed(struct torch_t *, uint64_t *);
+void		free_torch(struct torch_t *);
+void		cmd_torch(struct torch_t *, const char *, int, char *);
+void		newMessage(struct torch_t *, char *);
+const char	*torch_name(struct torch_t *);
+uint64_t	torch_hash(struct torch_t *, uint64_t);
+int		torch_rate(struct torch_t *);
+int		torch_catchup(struct torch_t *);
+void		torch_overrun(struct torch_t *, uint64_t);
+const char	*stage_name(int);